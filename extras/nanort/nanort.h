@@ -727,6 +727,25 @@ class BVHAccel {
   const std::vector<BVHNode<T> > &GetNodes() const { return nodes_; }
   const std::vector<unsigned int> &GetIndices() const { return indices_; }
 
+  ///
+  /// Mutable access to the nodes, e.g. to refit bounds after vertices move.
+  ///
+  std::vector<BVHNode<T> > &GetMutableNodes() { return nodes_; }
+
+  ///
+  /// Adopt a tree that was built outside of Build(), e.g. a linear BVH.
+  /// nodes[0] must be the root, and leaves must refer to ranges in `indices`.
+  /// The input vectors are swapped out and left empty.
+  ///
+  void Assign(std::vector<BVHNode<T> > *nodes,
+              std::vector<unsigned int> *indices,
+              const BVHBuildStatistics &stats) {
+    nodes_.swap(*nodes);
+    indices_.swap(*indices);
+    bboxes_.clear();
+    stats_ = stats;
+  }
+
   ///
   /// Returns bounding box of built BVH.
   ///
@@ -835,6 +854,11 @@ class TriangleSAHPred {
     pos_ = pos;
   }
 
+  ///
+  /// Points at a new vertex array with the same layout, e.g. after a refit.
+  ///
+  void SetVertices(const T *vertices) { vertices_ = vertices; }
+
   bool operator()(unsigned int i) const {
     int axis = axis_;
     T pos = pos_;
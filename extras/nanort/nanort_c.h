@@ -35,6 +35,17 @@ typedef struct {
   size_t num_triangles;
 } part_mesh;
 
+typedef enum {
+  PART_BUILDER_BINNED_SAH,  // nanort's top-down SAH build, best trace speed
+  PART_BUILDER_LBVH,        // Morton-sorted linear BVH, fastest to rebuild
+} part_builder;
+
+// Half-open range of vertex indices, [first, first + count).
+typedef struct {
+  size_t first;
+  size_t count;
+} part_range;
+
 typedef struct {
   float cost_t_aabb;
   uint32_t min_leaf_primitives;
@@ -43,17 +54,156 @@ typedef struct {
   uint32_t shallow_depth;
   bool cache_bbox;
   bool cull_backfaces;
+  part_builder builder;
+  bool optimize_treelets;  // LBVH only: rotate treelets to lower SAH cost
 } part_config;
 
+typedef struct {
+  uint32_t max_tree_depth;
+  uint32_t num_leaf_nodes;
+  uint32_t num_branch_nodes;
+  float build_secs;
+  size_t num_bytes;  // nodes, primitive indices and the copy of the faces
+} part_build_stats;
+
+// Traversal counters summed over every query made against a context. These
+// are only gathered when PART_ENABLE_STATS is defined; otherwise they compile
+// away and read back as zero.
+typedef struct {
+  uint64_t rays;
+  uint64_t aabb_tests;
+  uint64_t nodes_visited;  // nodes whose bounds the ray entered
+  uint64_t leaf_visits;
+  uint64_t triangle_tests;
+} part_trace_stats;
+
 typedef struct part_context_s part_context;
 
-part_context* part_create_context(part_config config, part_mesh mesh);
+// `stats` is optional and receives the shape and timing of the built tree.
+part_context* part_create_context(part_config config, part_mesh mesh,
+                                  part_build_stats* stats);
 
 void part_destroy_context(part_context* ctx);
 
 bool part_trace(const part_context* ctx, part_ray ray,
                 part_intersection* isect);
 
+// Same as part_trace, and also writes the counters for this one query to
+// `stats`, which is safe while other threads trace the same context.
+bool part_trace_with_stats(const part_context* ctx, part_ray ray,
+                           part_intersection* isect, part_trace_stats* stats);
+
+// Returns true if anything lies along the ray within [min_t, max_t]. This
+// stops at the first hit found rather than searching for the closest one, so
+// it is the cheaper choice for line-of-sight and shadow tests. Back faces are
+// skipped if the context was created with cull_backfaces.
+bool part_occluded(const part_context* ctx, part_ray ray);
+
+// Batched form of part_occluded, writes one result per ray.
+void part_occluded_batch(const part_context* ctx, const part_ray* rays,
+                         size_t count, bool* results);
+
+// Finds every surface crossing along the ray, up to `max_hits` of them, and
+// writes them to `out` sorted front to back. If there are more crossings than
+// fit, the nearest ones are kept. Returns the number of hits written. No heap
+// memory is allocated per query.
+size_t part_trace_all(const part_context* ctx, part_ray ray,
+                      part_intersection* out, size_t max_hits);
+
+// Batched form of part_trace_all. Ray i writes to out[i * max_hits] and
+// stores its hit count in counts[i].
+void part_trace_all_batch(const part_context* ctx, const part_ray* rays,
+                          size_t count, part_intersection* out,
+                          size_t max_hits, size_t* counts);
+
+// Finds the point on the mesh nearest to `point`, ignoring anything farther
+// than `max_dist`. Writes the point to `closest` and fills in `nearest`, if not
+// NULL, with the triangle and the barycentric coordinates of the point. Its t
+// is the distance. Returns false if no triangle is within reach.
+bool part_closest_point(const part_context* ctx, const float point[3],
+                        float max_dist, float closest[3],
+                        part_intersection* nearest);
+
+// Finds the triangles that touch the convex region where a*x + b*y + c*z + d
+// >= 0 for every plane (a, b, c, d) in `planes`, which holds 4 floats per
+// plane. The test is conservative: a triangle is dropped only if all of its
+// corners are outside the same plane. Writes up to `capacity` triangle indices
+// to `out` and returns the total number found, which may be larger.
+size_t part_query_frustum(const part_context* ctx, const float* planes,
+                          size_t num_planes, uint32_t* out, size_t capacity);
+
+// Same as part_query_frustum, for the triangles whose bounds overlap the box.
+size_t part_query_aabb(const part_context* ctx, const float min_corner[3],
+                       const float max_corner[3], uint32_t* out,
+                       size_t capacity);
+
+void part_get_trace_stats(const part_context* ctx, part_trace_stats* stats);
+
+void part_reset_trace_stats(part_context* ctx);
+
+// Refits node bounds after the vertices in `range` have moved, without
+// rebuilding. The topology must be unchanged. `vertices` replaces the array
+// that was passed at creation and must outlive the context. The first call
+// builds vertex-to-leaf tables; after that, the cost depends only on the moved
+// vertices and the nodes above them.
+void part_update_vertices(part_context* ctx, const float* vertices,
+                          part_range range);
+
+// Reads or writes a config as "key value" lines, e.g. "bin_size 16". Keys
+// that are missing from the file are left untouched when reading.
+bool part_read_config(const char* filename, part_config* config);
+bool part_write_config(const char* filename, const part_config* config);
+
+// Returns the SAH cost of the built tree, normalized by the root's surface
+// area. Lower is better; use this to compare builders on the same mesh.
+float part_get_sah_cost(const part_context* ctx);
+
+// -----------------------------------------------------------------------------
+// Two-level scenes
+//
+// A scene is a small top-level BVH over instances of existing contexts, each
+// with its own transform. Contexts can be shared between instances, and
+// adding, removing or moving an instance only rebuilds the top level. The
+// scene does not own its contexts, which must outlive it.
+// -----------------------------------------------------------------------------
+
+typedef struct part_scene_s part_scene;
+
+typedef struct {
+  float u;
+  float v;
+  float t;
+  size_t triangle_index;
+  uint32_t instance_id;
+} part_scene_intersection;
+
+part_scene* part_create_scene(void);
+
+void part_destroy_scene(part_scene* scene);
+
+// Adds an instance of `ctx` and returns its id, which stays valid until it is
+// removed. `transform` is a column-major 4x4 affine object-to-world matrix.
+uint32_t part_scene_add(part_scene* scene, const part_context* ctx,
+                        const float transform[16]);
+
+// Removes an instance. Traces skip it right away, but its id is only handed out
+// again by part_scene_add after the next commit, since the top-level BVH still
+// refers to it until then. Returns false, and does nothing, if the id is not a
+// live instance.
+bool part_scene_remove(part_scene* scene, uint32_t instance_id);
+
+// Returns false, and does nothing, if the id is not a live instance.
+bool part_scene_set_transform(part_scene* scene, uint32_t instance_id,
+                              const float transform[16]);
+
+// Rebuilds the top-level BVH. Call this after adding, removing or moving
+// instances and before tracing.
+void part_scene_commit(part_scene* scene);
+
+// Finds the closest hit across all instances. Ray t values are in world space.
+bool part_scene_trace(const part_scene* scene, part_ray ray,
+                      part_scene_intersection* isect);
+
 #ifdef __cplusplus
 }
 #endif
@@ -65,17 +215,399 @@ bool part_trace(const part_context* ctx, part_ray ray,
 
 #include <nanort/nanort.h>
 
+#include <atomic>
+#include <chrono>
+
+#define kPART_LBVH_MORTON_BITS (10)      // per axis, 30 bits total
+#define kPART_MIN_ITEMS_PER_TASK (4096)  // for threaded loops
+#define kPART_TREELET_PASSES (2)
+
+typedef nanort::BVHNode<float> part__node;
+
+// Per-query counters, flushed to the context when the query finishes.
+typedef struct {
+  uint64_t aabb_tests;
+  uint64_t nodes_visited;
+  uint64_t leaf_visits;
+  uint64_t triangle_tests;
+} part__counters;
+
+#if defined(PART_ENABLE_STATS)
+#define PART_COUNT(counters, field) ((counters)->field++)
+#else
+#define PART_COUNT(counters, field) ((void)(counters))
+#endif
+
 struct part_context_s {
   nanort::BVHBuildOptions<float> options;
   nanort::TriangleMesh<float>* mesh;
   nanort::TriangleSAHPred<float>* surfaceAreaHeuristic;
-  nanort::BVHAccel<float> accel;    // TODO: fix leak
-  std::vector<unsigned int> faces;  // TODO: fix leak
+  nanort::BVHAccel<float> accel;
+  std::vector<unsigned int> faces;
   nanort::BVHTraceOptions* trace_options;
+
+  // Refit bookkeeping, built on the first call to part_update_vertices. The
+  // root is its own parent. vertex_prims lists the triangles that use each
+  // vertex, starting at vertex_prim_offsets[vertex].
+  std::vector<unsigned int> parents;
+  std::vector<unsigned int> depths;
+  std::vector<unsigned int> prim_leaves;
+  std::vector<unsigned int> vertex_prim_offsets;
+  std::vector<unsigned int> vertex_prims;
+  std::vector<unsigned char> dirty;
+  std::vector<std::vector<unsigned int> > dirty_levels;  // reused per refit
+
+#if defined(PART_ENABLE_STATS)
+  mutable std::atomic<uint64_t> rays;
+  mutable std::atomic<uint64_t> aabb_tests;
+  mutable std::atomic<uint64_t> nodes_visited;
+  mutable std::atomic<uint64_t> leaf_visits;
+  mutable std::atomic<uint64_t> triangle_tests;
+#endif
 };
 
-part_context* part_create_context(part_config config, part_mesh mesh) {
-  part_context* context = PAR_CALLOC(part_context, 1);
+static size_t part__num_tasks(size_t num_items) {
+#if defined(NANORT_USE_CPP11_FEATURE)
+  // Querying the core count is a system call, so skip it for small loops.
+  if (num_items < 2 * kPART_MIN_ITEMS_PER_TASK) {
+    return 1;
+  }
+  size_t num_threads = std::min(
+      size_t(kNANORT_MAX_THREADS),
+      std::max(size_t(1), size_t(std::thread::hardware_concurrency())));
+  return std::max(size_t(1),
+                  std::min(num_threads, num_items / kPART_MIN_ITEMS_PER_TASK));
+#else
+  (void)num_items;
+  return 1;
+#endif
+}
+
+// Invokes fn(task_index) for each task, on its own thread if available.
+template <class F>
+static void part__parallel_for(size_t num_tasks, const F& fn) {
+#if defined(NANORT_USE_CPP11_FEATURE)
+  if (num_tasks > 1) {
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < num_tasks; t++) {
+      workers.emplace_back(fn, t);
+    }
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    return;
+  }
+#endif
+  for (size_t t = 0; t < num_tasks; t++) {
+    fn(t);
+  }
+}
+
+static float part__surface_area(const part__node& node) {
+  const float dx = node.bmax[0] - node.bmin[0];
+  const float dy = node.bmax[1] - node.bmin[1];
+  const float dz = node.bmax[2] - node.bmin[2];
+  return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static void part__merge_bounds(part__node* dst, const part__node& a,
+                               const part__node& b) {
+  for (int k = 0; k < 3; k++) {
+    dst->bmin[k] = std::min(a.bmin[k], b.bmin[k]);
+    dst->bmax[k] = std::max(a.bmax[k], b.bmax[k]);
+  }
+}
+
+// Spreads the lower 10 bits of v so that there are two zeros between each bit.
+static uint32_t part__expand_bits(uint32_t v) {
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+static int part__highest_bit(uint32_t v) {
+  int bit = 0;
+  while (v >>= 1) {
+    bit++;
+  }
+  return bit;
+}
+
+// Stable LSD radix sort on the upper 32 bits of each key, 8 bits per pass.
+// Each task histograms and scatters its own contiguous slice of the input.
+static void part__radix_sort(std::vector<uint64_t>* keys) {
+  const size_t n = keys->size();
+  const size_t num_tasks = part__num_tasks(n);
+  const size_t slice = (n + num_tasks - 1) / num_tasks;
+  std::vector<uint64_t> scratch(n);
+  std::vector<size_t> offsets(num_tasks * 256);
+  uint64_t* src = keys->data();
+  uint64_t* dst = scratch.data();
+  for (int shift = 32; shift < 64; shift += 8) {
+    std::fill(offsets.begin(), offsets.end(), 0);
+    part__parallel_for(num_tasks, [&](size_t task) {
+      size_t* histogram = &offsets[task * 256];
+      const size_t end = std::min(n, (task + 1) * slice);
+      for (size_t i = task * slice; i < end; i++) {
+        histogram[(src[i] >> shift) & 0xff]++;
+      }
+    });
+    size_t sum = 0;
+    for (size_t digit = 0; digit < 256; digit++) {
+      for (size_t task = 0; task < num_tasks; task++) {
+        const size_t count = offsets[task * 256 + digit];
+        offsets[task * 256 + digit] = sum;
+        sum += count;
+      }
+    }
+    part__parallel_for(num_tasks, [&](size_t task) {
+      size_t* cursor = &offsets[task * 256];
+      const size_t end = std::min(n, (task + 1) * slice);
+      for (size_t i = task * slice; i < end; i++) {
+        dst[cursor[(src[i] >> shift) & 0xff]++] = src[i];
+      }
+    });
+    std::swap(src, dst);
+  }
+  // An even number of passes leaves the sorted keys back in the input vector.
+}
+
+typedef struct {
+  const uint64_t* keys;        // morton code in the upper 32 bits, prim below
+  const part__node* prim_box;  // per-primitive bounds
+  unsigned int min_leaf_primitives;
+  unsigned int max_tree_depth;
+  std::vector<part__node>* nodes;
+  nanort::BVHBuildStatistics* stats;
+} part__lbvh_builder;
+
+// Emits nodes in depth-first order by splitting the sorted range at its
+// highest differing morton bit, which is a spatial median on one axis.
+static unsigned int part__emit_lbvh(part__lbvh_builder* builder,
+                                    unsigned int first, unsigned int last,
+                                    unsigned int depth) {
+  std::vector<part__node>& nodes = *builder->nodes;
+  const unsigned int offset = static_cast<unsigned int>(nodes.size());
+  nodes.push_back(part__node());
+  builder->stats->max_tree_depth =
+      std::max(builder->stats->max_tree_depth, depth);
+
+  const unsigned int n = last - first;
+  if (n <= builder->min_leaf_primitives || depth >= builder->max_tree_depth) {
+    part__node leaf = builder->prim_box[builder->keys[first] & 0xffffffffu];
+    for (unsigned int i = first + 1; i < last; i++) {
+      part__merge_bounds(&leaf, leaf,
+                         builder->prim_box[builder->keys[i] & 0xffffffffu]);
+    }
+    leaf.flag = 1;
+    leaf.axis = 0;
+    leaf.data[0] = n;
+    leaf.data[1] = first;
+    nodes[offset] = leaf;
+    builder->stats->num_leaf_nodes++;
+    return offset;
+  }
+
+  const uint32_t first_code = uint32_t(builder->keys[first] >> 32);
+  const uint32_t last_code = uint32_t(builder->keys[last - 1] >> 32);
+  unsigned int split = first + n / 2;
+  int axis = 0;
+  if (first_code != last_code) {
+    const int bit = part__highest_bit(first_code ^ last_code);
+    unsigned int lo = first;
+    unsigned int hi = last - 1;
+    while (lo < hi) {
+      const unsigned int mid = lo + (hi - lo) / 2;
+      if ((builder->keys[mid] >> (32 + bit)) & 1) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    split = lo;
+    axis = 2 - bit % 3;  // x occupies the most significant bit of each triple
+  }
+
+  const unsigned int left = part__emit_lbvh(builder, first, split, depth + 1);
+  const unsigned int right = part__emit_lbvh(builder, split, last, depth + 1);
+
+  part__node& node = nodes[offset];
+  part__merge_bounds(&node, nodes[left], nodes[right]);
+  node.flag = 0;
+  node.axis = axis;
+  node.data[0] = left;
+  node.data[1] = right;
+  builder->stats->num_branch_nodes++;
+  return offset;
+}
+
+// Traversal visits data[0] first when the ray points along +axis, so keep the
+// child with the smaller centroid on the split axis in slot 0.
+static void part__orient_children(std::vector<part__node>* nodes,
+                                  unsigned int index) {
+  part__node& node = (*nodes)[index];
+  const part__node& a = (*nodes)[node.data[0]];
+  const part__node& b = (*nodes)[node.data[1]];
+  float best = -1.0f;
+  for (int k = 0; k < 3; k++) {
+    const float d = (b.bmin[k] + b.bmax[k]) - (a.bmin[k] + a.bmax[k]);
+    if (std::fabs(d) > best) {
+      best = std::fabs(d);
+      node.axis = k;
+    }
+  }
+  const int k = node.axis;
+  if ((a.bmin[k] + a.bmax[k]) > (b.bmin[k] + b.bmax[k])) {
+    std::swap(node.data[0], node.data[1]);
+  }
+}
+
+// Post-order pass over three-level treelets (Kensler's tree rotations): swap a
+// child with one of its nephews whenever that shrinks the sibling's surface
+// area. Morton splits are spatial medians, so this recovers much of the SAH
+// quality gap at a small fraction of the cost of a binned build.
+static void part__rotate_treelets(std::vector<part__node>* nodes,
+                                  unsigned int index) {
+  if ((*nodes)[index].flag) {
+    return;
+  }
+  part__rotate_treelets(nodes, (*nodes)[index].data[0]);
+  part__rotate_treelets(nodes, (*nodes)[index].data[1]);
+
+  part__node& node = (*nodes)[index];
+  float best_gain = 0.0f;
+  int best_side = -1;
+  int best_grandchild = -1;
+  for (int side = 0; side < 2; side++) {
+    const part__node& child = (*nodes)[node.data[side]];
+    const part__node& other = (*nodes)[node.data[1 - side]];
+    if (other.flag) {
+      continue;
+    }
+    const float other_area = part__surface_area(other);
+    for (int g = 0; g < 2; g++) {
+      part__node merged;
+      part__merge_bounds(&merged, child, (*nodes)[other.data[1 - g]]);
+      const float gain = other_area - part__surface_area(merged);
+      if (gain > best_gain) {
+        best_gain = gain;
+        best_side = side;
+        best_grandchild = g;
+      }
+    }
+  }
+  if (best_side < 0) {
+    return;
+  }
+
+  const unsigned int other_index = node.data[1 - best_side];
+  part__node& other = (*nodes)[other_index];
+  std::swap(node.data[best_side], other.data[best_grandchild]);
+  part__merge_bounds(&other, (*nodes)[other.data[0]], (*nodes)[other.data[1]]);
+  part__orient_children(nodes, other_index);
+  part__orient_children(nodes, index);
+}
+
+static bool part__build_lbvh(part_context* context, part_mesh mesh,
+                             bool optimize_treelets) {
+  const size_t n = mesh.num_triangles;
+  if (n == 0) {
+    return false;
+  }
+  const float* vertices = mesh.vertices;
+  const unsigned int* faces = context->faces.data();
+
+  // 1. Per-primitive bounds and the bounds of all centroids.
+  std::vector<part__node> prim_box(n);
+  const size_t num_tasks = part__num_tasks(n);
+  const size_t slice = (n + num_tasks - 1) / num_tasks;
+  std::vector<part__node> centroid_box(num_tasks);
+  part__parallel_for(num_tasks, [&](size_t task) {
+    part__node& cbox = centroid_box[task];
+    for (int k = 0; k < 3; k++) {
+      cbox.bmin[k] = std::numeric_limits<float>::max();
+      cbox.bmax[k] = -std::numeric_limits<float>::max();
+    }
+    const size_t end = std::min(n, (task + 1) * slice);
+    for (size_t i = task * slice; i < end; i++) {
+      const float* p0 = vertices + 3 * faces[3 * i + 0];
+      const float* p1 = vertices + 3 * faces[3 * i + 1];
+      const float* p2 = vertices + 3 * faces[3 * i + 2];
+      part__node& box = prim_box[i];
+      for (int k = 0; k < 3; k++) {
+        box.bmin[k] = std::min(p0[k], std::min(p1[k], p2[k]));
+        box.bmax[k] = std::max(p0[k], std::max(p1[k], p2[k]));
+        const float c = 0.5f * (box.bmin[k] + box.bmax[k]);
+        cbox.bmin[k] = std::min(cbox.bmin[k], c);
+        cbox.bmax[k] = std::max(cbox.bmax[k], c);
+      }
+    }
+  });
+  for (size_t task = 1; task < num_tasks; task++) {
+    part__merge_bounds(&centroid_box[0], centroid_box[0], centroid_box[task]);
+  }
+
+  // 2. Morton code for each centroid, paired with its primitive index.
+  const float kMaxCell = float((1 << kPART_LBVH_MORTON_BITS) - 1);
+  float scale[3];
+  for (int k = 0; k < 3; k++) {
+    const float extent = centroid_box[0].bmax[k] - centroid_box[0].bmin[k];
+    scale[k] = extent > 0.0f ? kMaxCell / extent : 0.0f;
+  }
+  std::vector<uint64_t> keys(n);
+  part__parallel_for(num_tasks, [&](size_t task) {
+    const size_t end = std::min(n, (task + 1) * slice);
+    for (size_t i = task * slice; i < end; i++) {
+      uint32_t cell[3];
+      for (int k = 0; k < 3; k++) {
+        const float c = 0.5f * (prim_box[i].bmin[k] + prim_box[i].bmax[k]);
+        cell[k] = uint32_t((c - centroid_box[0].bmin[k]) * scale[k]);
+      }
+      const uint32_t code = (part__expand_bits(cell[0]) << 2) |
+                            (part__expand_bits(cell[1]) << 1) |
+                            part__expand_bits(cell[2]);
+      keys[i] = (uint64_t(code) << 32) | uint64_t(i);
+    }
+  });
+
+  // 3. Sort, then emit the hierarchy.
+  part__radix_sort(&keys);
+
+  nanort::BVHBuildStatistics stats;
+  std::vector<part__node> nodes;
+  nodes.reserve(2 * n / std::max(1u, context->options.min_leaf_primitives));
+  part__lbvh_builder builder = {
+      keys.data(),
+      prim_box.data(),
+      context->options.min_leaf_primitives,
+      context->options.max_tree_depth,
+      &nodes,
+      &stats,
+  };
+  part__emit_lbvh(&builder, 0, static_cast<unsigned int>(n), 0);
+
+  if (optimize_treelets) {
+    for (int pass = 0; pass < kPART_TREELET_PASSES; pass++) {
+      part__rotate_treelets(&nodes, 0);
+    }
+  }
+
+  std::vector<unsigned int> indices(n);
+  for (size_t i = 0; i < n; i++) {
+    indices[i] = static_cast<unsigned int>(keys[i] & 0xffffffffu);
+  }
+
+  context->accel.Assign(&nodes, &indices, stats);
+  return true;
+}
+
+part_context* part_create_context(part_config config, part_mesh mesh,
+                                  part_build_stats* stats) {
+  // Use new rather than calloc so that the build options get nanort's defaults
+  // (a zeroed max_tree_depth would turn the whole mesh into a single leaf).
+  part_context* context = new part_context();
   if (config.bin_size) {
     context->options.bin_size = config.bin_size;
   }
@@ -110,32 +642,50 @@ part_context* part_create_context(part_config config, part_mesh mesh) {
   context->trace_options = new nanort::BVHTraceOptions();
   context->trace_options->cull_back_face = config.cull_backfaces;
 
-  bool ret =
-      context->accel.Build(mesh.num_triangles, *context->mesh,
-                           *context->surfaceAreaHeuristic, context->options);
+  // Both builders are timed over the same span, from the triangle list to a
+  // finished tree, so that their build times can be compared directly.
+  const std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  bool ret = false;
+  if (config.builder == PART_BUILDER_LBVH) {
+    ret = part__build_lbvh(context, mesh, config.optimize_treelets);
+  } else {
+    ret = context->accel.Build(mesh.num_triangles, *context->mesh,
+                               *context->surfaceAreaHeuristic,
+                               context->options);
+  }
+  const float build_secs =
+      std::chrono::duration<float>(std::chrono::steady_clock::now() - start)
+          .count();
 
   if (!ret) {
-    // TODO: fix memory leak
+    part_destroy_context(context);
     return nullptr;
   }
 
+  if (stats) {
+    const nanort::BVHBuildStatistics nstats = context->accel.GetStatistics();
+    stats->max_tree_depth = nstats.max_tree_depth;
+    stats->num_leaf_nodes = nstats.num_leaf_nodes;
+    stats->num_branch_nodes = nstats.num_branch_nodes;
+    stats->build_secs = build_secs;
+    stats->num_bytes =
+        sizeof(part__node) * context->accel.GetNodes().size() +
+        sizeof(unsigned int) * context->accel.GetIndices().size() +
+        sizeof(unsigned int) * context->faces.size();
+  }
+
   return context;
 }
 
 void part_destroy_context(part_context* ctx) {
-  // TODO: invoke destructors in other members
   delete ctx->trace_options;
   delete ctx->mesh;
   delete ctx->surfaceAreaHeuristic;
-  PAR_FREE(ctx);
+  delete ctx;
 }
 
-bool part_trace(const part_context* ctx, part_ray ray,
-                part_intersection* intersection) {
-  nanort::TriangleIntersector<float> intersector(
-      ctx->mesh->vertices_, ctx->mesh->faces_, sizeof(float) * 3);
-  nanort::TriangleIntersection<float> isect;
-
+static nanort::Ray<float> part__convert_ray(const part_ray& ray) {
   nanort::Ray<float> nray;
   nray.org[0] = ray.org[0];
   nray.org[1] = ray.org[1];
@@ -145,12 +695,469 @@ bool part_trace(const part_context* ctx, part_ray ray,
   nray.dir[2] = ray.dir[2];
   nray.min_t = ray.min_t;
   nray.max_t = ray.max_t;
+  return nray;
+}
+
+// Walks the BVH near-to-far along the ray and calls visit(leaf) for each leaf
+// whose bounds overlap [ray.min_t, *max_t]. The visitor may shrink *max_t to
+// cull farther nodes, or return false to end the walk early.
+template <class V>
+static void part__walk(const nanort::BVHAccel<float>& accel,
+                       const nanort::Ray<float>& ray, float* max_t, V& visit,
+                       part__counters* counters) {
+  const std::vector<part__node>& nodes = accel.GetNodes();
+  if (nodes.empty()) {
+    return;
+  }
+
+  int dir_sign[3];
+  nanort::real3<float> ray_dir, ray_org;
+  for (int k = 0; k < 3; k++) {
+    dir_sign[k] = ray.dir[k] < 0.0f ? 1 : 0;
+    ray_dir[k] = ray.dir[k];
+    ray_org[k] = ray.org[k];
+  }
+  const nanort::real3<float> ray_inv_dir = nanort::vsafe_inverse(ray_dir);
+
+  int stack_index = 0;
+  unsigned int stack[kNANORT_MAX_STACK_DEPTH];
+  stack[0] = 0;
+  float tmin, tmax;
+  while (stack_index >= 0) {
+    const part__node& node = nodes[stack[stack_index--]];
+    PART_COUNT(counters, aabb_tests);
+    if (!nanort::IntersectRayAABB(&tmin, &tmax, ray.min_t, *max_t, node.bmin,
+                                  node.bmax, ray_org, ray_inv_dir,
+                                  dir_sign)) {
+      continue;
+    }
+    PART_COUNT(counters, nodes_visited);
+    if (node.flag == 0) {
+      const int order_near = dir_sign[node.axis];
+      stack[++stack_index] = node.data[1 - order_near];
+      stack[++stack_index] = node.data[order_near];
+      continue;
+    }
+    PART_COUNT(counters, leaf_visits);
+    if (!visit(node)) {
+      return;
+    }
+  }
+}
+
+static void part__flush_counters(const part_context* ctx,
+                                 const part__counters& counters) {
+#if defined(PART_ENABLE_STATS)
+  ctx->rays++;
+  ctx->aabb_tests += counters.aabb_tests;
+  ctx->nodes_visited += counters.nodes_visited;
+  ctx->leaf_visits += counters.leaf_visits;
+  ctx->triangle_tests += counters.triangle_tests;
+#else
+  (void)ctx;
+  (void)counters;
+#endif
+}
+
+bool part_occluded(const part_context* ctx, part_ray ray) {
+  const nanort::Ray<float> nray = part__convert_ray(ray);
+  nanort::TriangleIntersector<float> intersector(
+      ctx->mesh->vertices_, ctx->mesh->faces_, sizeof(float) * 3);
+  intersector.PrepareTraversal(nray, *ctx->trace_options);
+
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  part__counters counters = {};
+  float max_t = ray.max_t;
+  bool occluded = false;
+  auto visit = [&](const part__node& leaf) {
+    for (unsigned int i = 0; i < leaf.data[0]; i++) {
+      float t = max_t;
+      PART_COUNT(&counters, triangle_tests);
+      if (intersector.Intersect(&t, indices[leaf.data[1] + i])) {
+        occluded = true;
+        return false;
+      }
+    }
+    return true;
+  };
+  part__walk(ctx->accel, nray, &max_t, visit, &counters);
+  part__flush_counters(ctx, counters);
+  return occluded;
+}
+
+void part_occluded_batch(const part_context* ctx, const part_ray* rays,
+                         size_t count, bool* results) {
+  const size_t num_tasks = part__num_tasks(count);
+  const size_t slice = (count + num_tasks - 1) / num_tasks;
+  part__parallel_for(num_tasks, [&](size_t task) {
+    const size_t end = std::min(count, (task + 1) * slice);
+    for (size_t i = task * slice; i < end; i++) {
+      results[i] = part_occluded(ctx, rays[i]);
+    }
+  });
+}
+
+size_t part_trace_all(const part_context* ctx, part_ray ray,
+                      part_intersection* out, size_t max_hits) {
+  if (max_hits == 0) {
+    return 0;
+  }
+  const nanort::Ray<float> nray = part__convert_ray(ray);
+  nanort::TriangleIntersector<float> intersector(
+      ctx->mesh->vertices_, ctx->mesh->faces_, sizeof(float) * 3);
+  intersector.PrepareTraversal(nray, *ctx->trace_options);
+
+  // `out` is kept sorted by t. Once it is full, max_t tracks the farthest
+  // kept hit so that nodes beyond it are culled.
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  part__counters counters = {};
+  float max_t = ray.max_t;
+  size_t num_hits = 0;
+  auto visit = [&](const part__node& leaf) {
+    for (unsigned int i = 0; i < leaf.data[0]; i++) {
+      const unsigned int prim = indices[leaf.data[1] + i];
+      float t = max_t;
+      PART_COUNT(&counters, triangle_tests);
+      if (!intersector.Intersect(&t, prim)) {
+        continue;
+      }
+      nanort::TriangleIntersection<float> isect;
+      intersector.Update(t, prim);
+      intersector.PostTraversal(nray, true, &isect);
+
+      size_t slot = num_hits < max_hits ? num_hits++ : max_hits - 1;
+      while (slot > 0 && out[slot - 1].t > t) {
+        out[slot] = out[slot - 1];
+        slot--;
+      }
+      out[slot].u = isect.u;
+      out[slot].v = isect.v;
+      out[slot].t = isect.t;
+      out[slot].triangle_index = prim;
+      if (num_hits == max_hits) {
+        max_t = out[max_hits - 1].t;
+      }
+    }
+    return true;
+  };
+  part__walk(ctx->accel, nray, &max_t, visit, &counters);
+  part__flush_counters(ctx, counters);
+  return num_hits;
+}
 
-  bool hit =
-      ctx->accel.Traverse(nray, intersector, &isect, *ctx->trace_options);
+void part_trace_all_batch(const part_context* ctx, const part_ray* rays,
+                          size_t count, part_intersection* out,
+                          size_t max_hits, size_t* counts) {
+  const size_t num_tasks = part__num_tasks(count);
+  const size_t slice = (count + num_tasks - 1) / num_tasks;
+  part__parallel_for(num_tasks, [&](size_t task) {
+    const size_t end = std::min(count, (task + 1) * slice);
+    for (size_t i = task * slice; i < end; i++) {
+      counts[i] = part_trace_all(ctx, rays[i], out + i * max_hits, max_hits);
+    }
+  });
+}
+
+// Squared distance from p to the box, zero if p is inside.
+static float part__box_distance2(const part__node& node, const float p[3]) {
+  float d2 = 0.0f;
+  for (int k = 0; k < 3; k++) {
+    const float d = std::max(std::max(node.bmin[k] - p[k], p[k] - node.bmax[k]),
+                             0.0f);
+    d2 += d * d;
+  }
+  return d2;
+}
+
+// Closest point on triangle abc to p, from Ericson's "Real-Time Collision
+// Detection" 5.1.5. Writes the barycentric weights of b and c to u and v.
+static void part__closest_on_triangle(const float p[3], const float a[3],
+                                      const float b[3], const float c[3],
+                                      float* u, float* v) {
+  float ab[3], ac[3], ap[3], bp[3], cp[3];
+  for (int k = 0; k < 3; k++) {
+    ab[k] = b[k] - a[k];
+    ac[k] = c[k] - a[k];
+    ap[k] = p[k] - a[k];
+    bp[k] = p[k] - b[k];
+    cp[k] = p[k] - c[k];
+  }
+  auto dot = [](const float* x, const float* y) {
+    return x[0] * y[0] + x[1] * y[1] + x[2] * y[2];
+  };
+  const float d1 = dot(ab, ap), d2 = dot(ac, ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) {
+    *u = 0.0f, *v = 0.0f;
+    return;
+  }
+  const float d3 = dot(ab, bp), d4 = dot(ac, bp);
+  if (d3 >= 0.0f && d4 <= d3) {
+    *u = 1.0f, *v = 0.0f;
+    return;
+  }
+  const float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    *u = d1 / (d1 - d3), *v = 0.0f;
+    return;
+  }
+  const float d5 = dot(ab, cp), d6 = dot(ac, cp);
+  if (d6 >= 0.0f && d5 <= d6) {
+    *u = 0.0f, *v = 1.0f;
+    return;
+  }
+  const float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    *u = 0.0f, *v = d2 / (d2 - d6);
+    return;
+  }
+  const float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && (d4 - d3) >= 0.0f && (d5 - d6) >= 0.0f) {
+    *v = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    *u = 1.0f - *v;
+    return;
+  }
+  const float denom = 1.0f / (va + vb + vc);
+  *u = vb * denom;
+  *v = vc * denom;
+}
+
+bool part_closest_point(const part_context* ctx, const float point[3],
+                        float max_dist, float closest[3],
+                        part_intersection* nearest) {
+  const std::vector<part__node>& nodes = ctx->accel.GetNodes();
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  if (nodes.empty()) {
+    return false;
+  }
+  const float* vertices = ctx->mesh->vertices_;
+  const unsigned int* faces = ctx->mesh->faces_;
+
+  // Nodes are pruned by their distance to the best point so far, and the
+  // nearer child is visited first so that the bound shrinks quickly.
+  float best_d2 = max_dist * max_dist;
+  part_intersection best = {};
+  bool found = false;
+  int stack_index = 0;
+  unsigned int stack[kNANORT_MAX_STACK_DEPTH];
+  stack[0] = 0;
+  while (stack_index >= 0) {
+    const part__node& node = nodes[stack[stack_index--]];
+    if (part__box_distance2(node, point) > best_d2) {
+      continue;
+    }
+    if (node.flag == 0) {
+      const unsigned int a = node.data[0], b = node.data[1];
+      const bool a_first = part__box_distance2(nodes[a], point) <=
+                           part__box_distance2(nodes[b], point);
+      stack[++stack_index] = a_first ? b : a;
+      stack[++stack_index] = a_first ? a : b;
+      continue;
+    }
+    for (unsigned int i = 0; i < node.data[0]; i++) {
+      const unsigned int prim = indices[node.data[1] + i];
+      const float* v0 = vertices + 3 * faces[3 * prim + 0];
+      const float* v1 = vertices + 3 * faces[3 * prim + 1];
+      const float* v2 = vertices + 3 * faces[3 * prim + 2];
+      float u, v, q[3];
+      part__closest_on_triangle(point, v0, v1, v2, &u, &v);
+      float d2 = 0.0f;
+      for (int k = 0; k < 3; k++) {
+        q[k] = v0[k] + u * (v1[k] - v0[k]) + v * (v2[k] - v0[k]);
+        d2 += (q[k] - point[k]) * (q[k] - point[k]);
+      }
+      if (d2 <= best_d2) {
+        best_d2 = d2;
+        best.u = u;
+        best.v = v;
+        best.triangle_index = prim;
+        closest[0] = q[0], closest[1] = q[1], closest[2] = q[2];
+        found = true;
+      }
+    }
+  }
+  if (found && nearest) {
+    best.t = std::sqrt(best_d2);
+    *nearest = best;
+  }
+  return found;
+}
+
+// Collects the primitives under the nodes accepted by `classify`, which returns
+// -1 to cull a node, 1 if the node lies entirely inside the region and 0 if it
+// straddles the boundary. Subtrees that lie entirely inside are emitted without
+// further tests; primitives in straddling leaves are filtered by `keep`.
+template <class C, class K>
+static size_t part__query(const part_context* ctx, const C& classify,
+                          const K& keep, uint32_t* out, size_t capacity) {
+  const std::vector<part__node>& nodes = ctx->accel.GetNodes();
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  if (nodes.empty()) {
+    return 0;
+  }
+  size_t count = 0;
+  int stack_index = 0;
+  unsigned int stack[kNANORT_MAX_STACK_DEPTH];
+  bool inside_stack[kNANORT_MAX_STACK_DEPTH];
+  stack[0] = 0;
+  inside_stack[0] = false;
+  while (stack_index >= 0) {
+    const part__node& node = nodes[stack[stack_index]];
+    bool inside = inside_stack[stack_index--];
+    if (!inside) {
+      const int side = classify(node);
+      if (side < 0) {
+        continue;
+      }
+      inside = side > 0;
+    }
+    if (node.flag == 0) {
+      stack[++stack_index] = node.data[0];
+      inside_stack[stack_index] = inside;
+      stack[++stack_index] = node.data[1];
+      inside_stack[stack_index] = inside;
+      continue;
+    }
+    for (unsigned int i = 0; i < node.data[0]; i++) {
+      const unsigned int prim = indices[node.data[1] + i];
+      if (inside || keep(prim)) {
+        if (count < capacity) {
+          out[count] = prim;
+        }
+        count++;
+      }
+    }
+  }
+  return count;
+}
+
+size_t part_query_frustum(const part_context* ctx, const float* planes,
+                          size_t num_planes, uint32_t* out, size_t capacity) {
+  const float* vertices = ctx->mesh->vertices_;
+  const unsigned int* faces = ctx->mesh->faces_;
+  auto distance = [](const float* plane, float x, float y, float z) {
+    return plane[0] * x + plane[1] * y + plane[2] * z + plane[3];
+  };
+
+  // Tests the box corner farthest along each plane normal, then the nearest.
+  auto classify = [&](const part__node& node) {
+    int side = 1;
+    for (size_t i = 0; i < num_planes; i++) {
+      const float* plane = planes + 4 * i;
+      const float far_x = plane[0] >= 0.0f ? node.bmax[0] : node.bmin[0];
+      const float far_y = plane[1] >= 0.0f ? node.bmax[1] : node.bmin[1];
+      const float far_z = plane[2] >= 0.0f ? node.bmax[2] : node.bmin[2];
+      if (distance(plane, far_x, far_y, far_z) < 0.0f) {
+        return -1;
+      }
+      const float near_x = plane[0] >= 0.0f ? node.bmin[0] : node.bmax[0];
+      const float near_y = plane[1] >= 0.0f ? node.bmin[1] : node.bmax[1];
+      const float near_z = plane[2] >= 0.0f ? node.bmin[2] : node.bmax[2];
+      if (distance(plane, near_x, near_y, near_z) < 0.0f) {
+        side = 0;
+      }
+    }
+    return side;
+  };
+
+  auto keep = [&](unsigned int prim) {
+    for (size_t i = 0; i < num_planes; i++) {
+      const float* plane = planes + 4 * i;
+      bool all_outside = true;
+      for (int k = 0; k < 3 && all_outside; k++) {
+        const float* v = vertices + 3 * faces[3 * prim + k];
+        all_outside = distance(plane, v[0], v[1], v[2]) < 0.0f;
+      }
+      if (all_outside) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  return part__query(ctx, classify, keep, out, capacity);
+}
+
+size_t part_query_aabb(const part_context* ctx, const float min_corner[3],
+                       const float max_corner[3], uint32_t* out,
+                       size_t capacity) {
+  auto classify = [&](const part__node& node) {
+    int side = 1;
+    for (int k = 0; k < 3; k++) {
+      if (node.bmin[k] > max_corner[k] || node.bmax[k] < min_corner[k]) {
+        return -1;
+      }
+      if (node.bmin[k] < min_corner[k] || node.bmax[k] > max_corner[k]) {
+        side = 0;
+      }
+    }
+    return side;
+  };
+
+  auto keep = [&](unsigned int prim) {
+    nanort::real3<float> bmin, bmax;
+    ctx->mesh->BoundingBox(&bmin, &bmax, prim);
+    for (int k = 0; k < 3; k++) {
+      if (bmin[k] > max_corner[k] || bmax[k] < min_corner[k]) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  return part__query(ctx, classify, keep, out, capacity);
+}
+
+bool part_trace(const part_context* ctx, part_ray ray,
+                part_intersection* intersection) {
+  return part_trace_with_stats(ctx, ray, intersection, nullptr);
+}
+
+bool part_trace_with_stats(const part_context* ctx, part_ray ray,
+                           part_intersection* intersection,
+                           part_trace_stats* stats) {
+  const nanort::Ray<float> nray = part__convert_ray(ray);
+  nanort::TriangleIntersector<float> intersector(
+      ctx->mesh->vertices_, ctx->mesh->faces_, sizeof(float) * 3);
+  intersector.Update(ray.max_t, static_cast<unsigned int>(-1));
+  intersector.PrepareTraversal(nray, *ctx->trace_options);
+
+  // Same closest-hit search as BVHAccel::Traverse, but routed through
+  // part__walk so that it can be instrumented.
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  part__counters counters = {};
+  float max_t = ray.max_t;
+  bool hit = false;
+  auto visit = [&](const part__node& leaf) {
+    for (unsigned int i = 0; i < leaf.data[0]; i++) {
+      const unsigned int prim = indices[leaf.data[1] + i];
+      float t = max_t;
+      PART_COUNT(&counters, triangle_tests);
+      if (intersector.Intersect(&t, prim)) {
+        max_t = t;
+        intersector.Update(t, prim);
+        hit = true;
+      }
+    }
+    return true;
+  };
+  part__walk(ctx->accel, nray, &max_t, visit, &counters);
+  part__flush_counters(ctx, counters);
+  if (stats) {
+    memset(stats, 0, sizeof(*stats));
+#if defined(PART_ENABLE_STATS)
+    stats->rays = 1;
+    stats->aabb_tests = counters.aabb_tests;
+    stats->nodes_visited = counters.nodes_visited;
+    stats->leaf_visits = counters.leaf_visits;
+    stats->triangle_tests = counters.triangle_tests;
+#endif
+  }
   if (!hit) {
     return false;
   }
+
+  nanort::TriangleIntersection<float> isect;
+  intersector.PostTraversal(nray, true, &isect);
   intersection->u = isect.u;
   intersection->v = isect.v;
   intersection->t = isect.t;
@@ -158,5 +1165,472 @@ bool part_trace(const part_context* ctx, part_ray ray,
   return true;
 }
 
+void part_get_trace_stats(const part_context* ctx, part_trace_stats* stats) {
+  memset(stats, 0, sizeof(*stats));
+#if defined(PART_ENABLE_STATS)
+  stats->rays = ctx->rays;
+  stats->aabb_tests = ctx->aabb_tests;
+  stats->nodes_visited = ctx->nodes_visited;
+  stats->leaf_visits = ctx->leaf_visits;
+  stats->triangle_tests = ctx->triangle_tests;
+#else
+  (void)ctx;
+#endif
+}
+
+void part_reset_trace_stats(part_context* ctx) {
+#if defined(PART_ENABLE_STATS)
+  ctx->rays = 0;
+  ctx->aabb_tests = 0;
+  ctx->nodes_visited = 0;
+  ctx->leaf_visits = 0;
+  ctx->triangle_tests = 0;
+#else
+  (void)ctx;
+#endif
+}
+
+static void part__prepare_refit(part_context* ctx) {
+  const std::vector<part__node>& nodes = ctx->accel.GetNodes();
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  ctx->parents.assign(nodes.size(), 0);
+  ctx->depths.assign(nodes.size(), 0);
+  ctx->prim_leaves.assign(indices.size(), 0);
+  ctx->dirty.assign(nodes.size(), 0);
+  ctx->dirty_levels.clear();
+
+  // Bucket the triangles by vertex, so that a refit only visits the
+  // triangles of the vertices that moved.
+  const std::vector<unsigned int>& faces = ctx->faces;
+  unsigned int num_vertices = 0;
+  for (size_t i = 0; i < faces.size(); i++) {
+    num_vertices = std::max(num_vertices, faces[i] + 1);
+  }
+  ctx->vertex_prim_offsets.assign(num_vertices + 1, 0);
+  for (size_t i = 0; i < faces.size(); i++) {
+    ctx->vertex_prim_offsets[faces[i] + 1]++;
+  }
+  for (unsigned int v = 0; v < num_vertices; v++) {
+    ctx->vertex_prim_offsets[v + 1] += ctx->vertex_prim_offsets[v];
+  }
+  ctx->vertex_prims.resize(faces.size());
+  std::vector<unsigned int> cursor(ctx->vertex_prim_offsets.begin(),
+                                   ctx->vertex_prim_offsets.end() - 1);
+  for (size_t i = 0; i < faces.size(); i++) {
+    ctx->vertex_prims[cursor[faces[i]]++] = static_cast<unsigned int>(i / 3);
+  }
+
+  // Nodes are not guaranteed to follow their parents after treelet rotation,
+  // so walk the tree to find depths instead of relying on index order.
+  std::vector<std::pair<unsigned int, unsigned int> > stack;
+  stack.push_back(std::make_pair(0u, 0u));
+  while (!stack.empty()) {
+    const unsigned int index = stack.back().first;
+    const unsigned int depth = stack.back().second;
+    stack.pop_back();
+    const part__node& node = nodes[index];
+    if (node.flag) {
+      for (unsigned int i = 0; i < node.data[0]; i++) {
+        ctx->prim_leaves[indices[node.data[1] + i]] = index;
+      }
+      continue;
+    }
+    ctx->depths[index] = depth;
+    if (ctx->dirty_levels.size() <= depth) {
+      ctx->dirty_levels.resize(depth + 1);
+    }
+    for (int c = 0; c < 2; c++) {
+      ctx->parents[node.data[c]] = index;
+      stack.push_back(std::make_pair(node.data[c], depth + 1));
+    }
+  }
+}
+
+void part_update_vertices(part_context* ctx, const float* vertices,
+                          part_range range) {
+  if (ctx->parents.empty()) {
+    part__prepare_refit(ctx);
+  }
+
+  // The SAH predictor is only used by builds, but keep it pointing at live
+  // vertices rather than recreating it.
+  ctx->mesh->vertices_ = vertices;
+  ctx->surfaceAreaHeuristic->SetVertices(vertices);
+
+  std::vector<part__node>& nodes = ctx->accel.GetMutableNodes();
+  const std::vector<unsigned int>& indices = ctx->accel.GetIndices();
+  const unsigned int* faces = ctx->faces.data();
+  const size_t num_vertices = ctx->vertex_prim_offsets.size() - 1;
+  const size_t first = std::min(range.first, num_vertices);
+  const size_t last = std::min(range.first + range.count, num_vertices);
+
+  // 1. Find the leaves that reference a moved vertex.
+  std::vector<unsigned int> leaves;
+  for (size_t v = first; v < last; v++) {
+    for (unsigned int i = ctx->vertex_prim_offsets[v];
+         i < ctx->vertex_prim_offsets[v + 1]; i++) {
+      const unsigned int leaf = ctx->prim_leaves[ctx->vertex_prims[i]];
+      if (!ctx->dirty[leaf]) {
+        ctx->dirty[leaf] = 1;
+        leaves.push_back(leaf);
+      }
+    }
+  }
+  if (leaves.empty()) {
+    return;
+  }
+
+  // 2. Collect every ancestor of a dirty leaf by depth, stopping at paths that
+  // are already collected.
+  for (size_t i = 0; i < leaves.size(); i++) {
+    unsigned int index = leaves[i];
+    while (index != 0) {
+      index = ctx->parents[index];
+      if (ctx->dirty[index]) {
+        break;
+      }
+      ctx->dirty[index] = 1;
+      ctx->dirty_levels[ctx->depths[index]].push_back(index);
+    }
+  }
+
+  // 3. Refit dirty leaves from their triangles.
+  const size_t leaf_tasks = part__num_tasks(leaves.size());
+  const size_t leaf_slice = (leaves.size() + leaf_tasks - 1) / leaf_tasks;
+  part__parallel_for(leaf_tasks, [&](size_t task) {
+    const size_t end = std::min(leaves.size(), (task + 1) * leaf_slice);
+    for (size_t i = task * leaf_slice; i < end; i++) {
+      part__node& leaf = nodes[leaves[i]];
+      for (int k = 0; k < 3; k++) {
+        leaf.bmin[k] = std::numeric_limits<float>::max();
+        leaf.bmax[k] = -std::numeric_limits<float>::max();
+      }
+      for (unsigned int p = 0; p < leaf.data[0]; p++) {
+        const unsigned int prim = indices[leaf.data[1] + p];
+        for (int c = 0; c < 3; c++) {
+          const float* v = vertices + 3 * faces[3 * prim + c];
+          for (int k = 0; k < 3; k++) {
+            leaf.bmin[k] = std::min(leaf.bmin[k], v[k]);
+            leaf.bmax[k] = std::max(leaf.bmax[k], v[k]);
+          }
+        }
+      }
+      ctx->dirty[leaves[i]] = 0;
+    }
+  });
+
+  // 4. Refit the collected branches one level at a time, deepest first. Nodes
+  // within a level are independent so each level can be split across threads.
+  for (size_t depth = ctx->dirty_levels.size(); depth-- > 0;) {
+    std::vector<unsigned int>& level = ctx->dirty_levels[depth];
+    const size_t level_tasks = part__num_tasks(level.size());
+    const size_t level_slice = (level.size() + level_tasks - 1) / level_tasks;
+    part__parallel_for(level_tasks, [&](size_t task) {
+      const size_t end = std::min(level.size(), (task + 1) * level_slice);
+      for (size_t i = task * level_slice; i < end; i++) {
+        part__node& node = nodes[level[i]];
+        part__merge_bounds(&node, nodes[node.data[0]], nodes[node.data[1]]);
+        ctx->dirty[level[i]] = 0;
+      }
+    });
+    level.clear();
+  }
+}
+
+bool part_read_config(const char* filename, part_config* config) {
+  FILE* fp = fopen(filename, "r");
+  if (!fp) {
+    return false;
+  }
+  char key[64];
+  char value[64];
+  while (fscanf(fp, "%63s %63s", key, value) == 2) {
+    const std::string k(key);
+    const unsigned int u = static_cast<unsigned int>(strtoul(value, NULL, 10));
+    if (k == "builder") {
+      config->builder = strcmp(value, "lbvh") ? PART_BUILDER_BINNED_SAH
+                                              : PART_BUILDER_LBVH;
+    } else if (k == "cost_t_aabb") {
+      config->cost_t_aabb = strtof(value, NULL);
+    } else if (k == "min_leaf_primitives") {
+      config->min_leaf_primitives = u;
+    } else if (k == "max_tree_depth") {
+      config->max_tree_depth = u;
+    } else if (k == "bin_size") {
+      config->bin_size = u;
+    } else if (k == "shallow_depth") {
+      config->shallow_depth = u;
+    } else if (k == "cache_bbox") {
+      config->cache_bbox = u != 0;
+    } else if (k == "cull_backfaces") {
+      config->cull_backfaces = u != 0;
+    } else if (k == "optimize_treelets") {
+      config->optimize_treelets = u != 0;
+    }
+  }
+  fclose(fp);
+  return true;
+}
+
+bool part_write_config(const char* filename, const part_config* config) {
+  FILE* fp = fopen(filename, "w");
+  if (!fp) {
+    return false;
+  }
+  fprintf(fp, "builder %s\n",
+          config->builder == PART_BUILDER_LBVH ? "lbvh" : "binned_sah");
+  fprintf(fp, "cost_t_aabb %g\n", config->cost_t_aabb);
+  fprintf(fp, "min_leaf_primitives %u\n", config->min_leaf_primitives);
+  fprintf(fp, "max_tree_depth %u\n", config->max_tree_depth);
+  fprintf(fp, "bin_size %u\n", config->bin_size);
+  fprintf(fp, "shallow_depth %u\n", config->shallow_depth);
+  fprintf(fp, "cache_bbox %d\n", config->cache_bbox ? 1 : 0);
+  fprintf(fp, "cull_backfaces %d\n", config->cull_backfaces ? 1 : 0);
+  fprintf(fp, "optimize_treelets %d\n", config->optimize_treelets ? 1 : 0);
+  fclose(fp);
+  return true;
+}
+
+float part_get_sah_cost(const part_context* ctx) {
+  const std::vector<part__node>& nodes = ctx->accel.GetNodes();
+  if (nodes.empty()) {
+    return 0.0f;
+  }
+  const float root_area = part__surface_area(nodes[0]);
+  if (root_area <= 0.0f) {
+    return 0.0f;
+  }
+
+  // Same weights as nanort's binned SAH: Ttri = 1 - Taabb.
+  const double cost_aabb = ctx->options.cost_t_aabb;
+  const double cost_tri = 1.0 - cost_aabb;
+  double cost = 0.0;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    const double area = part__surface_area(nodes[i]);
+    if (nodes[i].flag) {
+      cost += area * cost_tri * nodes[i].data[0];
+    } else {
+      cost += area * cost_aabb * 2.0;
+    }
+  }
+  return float(cost / root_area);
+}
+
+// -----------------------------------------------------------------------------
+// Two-level scenes
+// -----------------------------------------------------------------------------
+
+typedef struct {
+  const part_context* ctx;  // null if the slot is free
+  float transform[16];
+  float inverse[16];
+  float bmin[3];
+  float bmax[3];
+} part__instance;
+
+struct part_scene_s {
+  std::vector<part__instance> instances;
+  std::vector<uint32_t> free_ids;
+  std::vector<uint32_t> removed_ids;  // freed by the next commit
+  std::vector<uint32_t> live_ids;  // top-level primitive index to instance id
+  nanort::BVHAccel<float> accel;
+};
+
+// Feeds instance bounds to nanort's top-level build.
+class part__instance_boxes {
+ public:
+  explicit part__instance_boxes(const part_scene* scene) : scene_(scene) {}
+  void BoundingBox(nanort::real3<float>* bmin, nanort::real3<float>* bmax,
+                   unsigned int prim) const {
+    const part__instance& inst = scene_->instances[scene_->live_ids[prim]];
+    for (int k = 0; k < 3; k++) {
+      (*bmin)[k] = inst.bmin[k];
+      (*bmax)[k] = inst.bmax[k];
+    }
+  }
+
+ private:
+  const part_scene* scene_;
+};
+
+class part__instance_pred {
+ public:
+  explicit part__instance_pred(const part_scene* scene)
+      : scene_(scene), axis_(0), pos_(0.0f) {}
+  void Set(int axis, float pos) const {
+    axis_ = axis;
+    pos_ = pos;
+  }
+  bool operator()(unsigned int prim) const {
+    const part__instance& inst = scene_->instances[scene_->live_ids[prim]];
+    return inst.bmin[axis_] + inst.bmax[axis_] < 2.0f * pos_;
+  }
+
+ private:
+  const part_scene* scene_;
+  mutable int axis_;
+  mutable float pos_;
+};
+
+// Inverts a column-major affine matrix.
+static void part__invert_affine(float dst[16], const float m[16]) {
+  const float a = m[0], b = m[4], c = m[8];
+  const float d = m[1], e = m[5], f = m[9];
+  const float g = m[2], h = m[6], i = m[10];
+  const float A = e * i - f * h, B = f * g - d * i, C = d * h - e * g;
+  const float inv_det = 1.0f / (a * A + b * B + c * C);
+  dst[0] = A * inv_det;
+  dst[1] = B * inv_det;
+  dst[2] = C * inv_det;
+  dst[4] = (c * h - b * i) * inv_det;
+  dst[5] = (a * i - c * g) * inv_det;
+  dst[6] = (b * g - a * h) * inv_det;
+  dst[8] = (b * f - c * e) * inv_det;
+  dst[9] = (c * d - a * f) * inv_det;
+  dst[10] = (a * e - b * d) * inv_det;
+  dst[3] = dst[7] = dst[11] = 0.0f;
+  for (int r = 0; r < 3; r++) {
+    dst[12 + r] =
+        -(dst[r] * m[12] + dst[4 + r] * m[13] + dst[8 + r] * m[14]);
+  }
+  dst[15] = 1.0f;
+}
+
+static void part__transform_point(float dst[3], const float m[16],
+                                  const float p[3], float w) {
+  for (int r = 0; r < 3; r++) {
+    dst[r] = m[r] * p[0] + m[4 + r] * p[1] + m[8 + r] * p[2] + m[12 + r] * w;
+  }
+}
+
+static void part__update_instance(part__instance* inst,
+                                  const float transform[16]) {
+  memcpy(inst->transform, transform, sizeof(inst->transform));
+  part__invert_affine(inst->inverse, transform);
+  float bmin[3], bmax[3];
+  inst->ctx->accel.BoundingBox(bmin, bmax);
+  for (int k = 0; k < 3; k++) {
+    inst->bmin[k] = std::numeric_limits<float>::max();
+    inst->bmax[k] = -std::numeric_limits<float>::max();
+  }
+  for (int corner = 0; corner < 8; corner++) {
+    const float p[3] = {
+        (corner & 1) ? bmax[0] : bmin[0],
+        (corner & 2) ? bmax[1] : bmin[1],
+        (corner & 4) ? bmax[2] : bmin[2],
+    };
+    float q[3];
+    part__transform_point(q, transform, p, 1.0f);
+    for (int k = 0; k < 3; k++) {
+      inst->bmin[k] = std::min(inst->bmin[k], q[k]);
+      inst->bmax[k] = std::max(inst->bmax[k], q[k]);
+    }
+  }
+}
+
+part_scene* part_create_scene(void) { return new part_scene_s(); }
+
+void part_destroy_scene(part_scene* scene) { delete scene; }
+
+uint32_t part_scene_add(part_scene* scene, const part_context* ctx,
+                        const float transform[16]) {
+  uint32_t id;
+  if (scene->free_ids.empty()) {
+    id = static_cast<uint32_t>(scene->instances.size());
+    scene->instances.push_back(part__instance());
+  } else {
+    id = scene->free_ids.back();
+    scene->free_ids.pop_back();
+  }
+  part__instance& inst = scene->instances[id];
+  inst.ctx = ctx;
+  part__update_instance(&inst, transform);
+  return id;
+}
+
+static bool part__is_live(const part_scene* scene, uint32_t instance_id) {
+  return instance_id < scene->instances.size() &&
+         scene->instances[instance_id].ctx;
+}
+
+bool part_scene_remove(part_scene* scene, uint32_t instance_id) {
+  if (!part__is_live(scene, instance_id)) {
+    return false;
+  }
+  scene->instances[instance_id].ctx = nullptr;
+  scene->removed_ids.push_back(instance_id);
+  return true;
+}
+
+bool part_scene_set_transform(part_scene* scene, uint32_t instance_id,
+                              const float transform[16]) {
+  if (!part__is_live(scene, instance_id)) {
+    return false;
+  }
+  part__update_instance(&scene->instances[instance_id], transform);
+  return true;
+}
+
+void part_scene_commit(part_scene* scene) {
+  scene->free_ids.insert(scene->free_ids.end(), scene->removed_ids.begin(),
+                         scene->removed_ids.end());
+  scene->removed_ids.clear();
+  scene->live_ids.clear();
+  for (size_t i = 0; i < scene->instances.size(); i++) {
+    if (scene->instances[i].ctx) {
+      scene->live_ids.push_back(static_cast<uint32_t>(i));
+    }
+  }
+  if (scene->live_ids.empty()) {
+    std::vector<part__node> nodes;
+    std::vector<unsigned int> indices;
+    scene->accel.Assign(&nodes, &indices, nanort::BVHBuildStatistics());
+    return;
+  }
+  nanort::BVHBuildOptions<float> options;
+  options.min_leaf_primitives = 1;
+  scene->accel.Build(static_cast<unsigned int>(scene->live_ids.size()),
+                     part__instance_boxes(scene), part__instance_pred(scene),
+                     options);
+}
+
+bool part_scene_trace(const part_scene* scene, part_ray ray,
+                      part_scene_intersection* isect) {
+  const nanort::Ray<float> nray = part__convert_ray(ray);
+  const std::vector<unsigned int>& indices = scene->accel.GetIndices();
+  float max_t = ray.max_t;
+  bool hit = false;
+  auto visit = [&](const part__node& leaf) {
+    for (unsigned int i = 0; i < leaf.data[0]; i++) {
+      const uint32_t id = scene->live_ids[indices[leaf.data[1] + i]];
+      const part__instance& inst = scene->instances[id];
+      if (!inst.ctx) {
+        continue;  // removed since the last commit
+      }
+
+      // The direction is not renormalized, so t is the same in both spaces.
+      part_ray local = ray;
+      part__transform_point(local.org, inst.inverse, ray.org, 1.0f);
+      part__transform_point(local.dir, inst.inverse, ray.dir, 0.0f);
+      local.max_t = max_t;
+
+      part_intersection local_isect;
+      if (part_trace(inst.ctx, local, &local_isect)) {
+        hit = true;
+        max_t = local_isect.t;
+        isect->u = local_isect.u;
+        isect->v = local_isect.v;
+        isect->t = local_isect.t;
+        isect->triangle_index = local_isect.triangle_index;
+        isect->instance_id = id;
+      }
+    }
+    return true;
+  };
+  part__counters counters = {};
+  part__walk(scene->accel, nray, &max_t, visit, &counters);
+  return hit;
+}
+
 #endif  // NANO_RT_C_IMPLEMENTATION
 #endif  // NANO_RT_C_H
@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <nanort/nanort_c.h>
 
@@ -15,10 +16,13 @@
 #include <sokol/sokol_time.h>
 
 #include "app.h"
+#include "ray_double.h"
 #include "ray_float.h"
+#include "trace.h"
 #include "vec_float.h"
 
 #define IMAX(a, b) (a > b ? a : b)
+#define IMIN(a, b) (a < b ? a : b)
 
 typedef struct {
     float x, y, z, w;
@@ -28,6 +32,13 @@ typedef struct {
     float x, y;
 } vec2;
 
+static bool consume_snapshot(SnapshotBuffer* buffer);
+static void goto_frame(App* app, parcc_frame goal);
+static void save_frame(App* app, int index);
+static void clear_frames(App* app);
+static void pick(App* app, int winx, int winy);
+static void select_rect(App* app, int winx0, int winy0, int winx1, int winy1);
+
 static void create_mesh(App* app, const char* filename) {
     int nchan;
     int width, height;
@@ -46,8 +57,14 @@ static void create_mesh(App* app, const char* filename) {
         par_msquares_grayscale(float_data, width, height, cellsize, 0.0f, PAR_MSQUARES_HEIGHTS);
 
     assert(meshes);
-    free(float_data);
+    app->heightmap = (Heightmap){
+        .data = float_data,
+        .width = width,
+        .height = height,
+        .scale = IMAX(width, height),
+    };
 
+    app->meshes = meshes;
     int nmeshes = par_msquares_get_count(meshes);
 
     par_msquares_mesh const* mesh = app->mesh = par_msquares_get_mesh(meshes, 0);
@@ -61,6 +78,17 @@ static void create_mesh(App* app, const char* filename) {
         float3_max(app->max_corner, app->max_corner, mesh->points + i);
     }
 
+    // Pick the row order under which the heightmap best predicts the mesh heights.
+    float error[2] = {0, 0};
+    for (int i = 0; i < mesh->npoints; i += IMAX(mesh->npoints / 256, 1)) {
+        const float* point = mesh->points + i * 3;
+        for (int flip = 0; flip < 2; flip++) {
+            app->heightmap.flip_y = flip;
+            error[flip] += fabsf(app_height_at(app, point[0], point[1]) - point[2]);
+        }
+    }
+    app->heightmap.flip_y = error[1] < error[0];
+
     printf("bounds = ");
     float3_print(stdout, app->min_corner);
     float3_print(stdout, app->max_corner);
@@ -91,6 +119,26 @@ static void create_mesh(App* app, const char* filename) {
     };
 
     app->gfx.num_elements = mesh->ntriangles * 3;
+
+    // Map each vertex to the triangles that use it, so that a hit can be refined against the
+    // triangles around it without another traversal.
+    const int num_corners = mesh->ntriangles * 3;
+    uint32_t* offsets = calloc(mesh->npoints + 1, sizeof(uint32_t));
+    uint32_t* triangles = malloc(sizeof(uint32_t) * num_corners);
+    for (int i = 0; i < num_corners; i++) {
+        offsets[mesh->triangles[i] + 1]++;
+    }
+    for (int i = 0; i < mesh->npoints; i++) {
+        offsets[i + 1] += offsets[i];
+    }
+    uint32_t* cursor = malloc(sizeof(uint32_t) * mesh->npoints);
+    memcpy(cursor, offsets, sizeof(uint32_t) * mesh->npoints);
+    for (int i = 0; i < num_corners; i++) {
+        triangles[cursor[mesh->triangles[i]]++] = i / 3;
+    }
+    free(cursor);
+    app->vertex_triangle_offsets = offsets;
+    app->vertex_triangles = triangles;
 }
 
 static void create_texture(App* app, const char* filename, int* width, int* height) {
@@ -138,39 +186,165 @@ static void create_texture(App* app, const char* filename, int* width, int* heig
     }
 }
 
+// Drops the low mantissa bits so that rays which differ only by float noise share a key.
+static uint32_t quantize_float(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits & ~0xfu;
+}
+
+float app_height_at(const App* app, float x, float y) {
+    const Heightmap* hm = &app->heightmap;
+    float px = x * hm->scale;
+    float py = y * hm->scale;
+    if (hm->flip_y) {
+        py = hm->height - 1 - py;
+    }
+    px = fminf(fmaxf(px, 0), hm->width - 1);
+    py = fminf(fmaxf(py, 0), hm->height - 1);
+    const int x0 = IMIN((int)px, hm->width - 2);
+    const int y0 = IMIN((int)py, hm->height - 2);
+    const float fx = px - x0;
+    const float fy = py - y0;
+    const float* row0 = hm->data + y0 * hm->width + x0;
+    const float* row1 = row0 + hm->width;
+    const float bottom = row0[0] + fx * (row0[1] - row0[0]);
+    const float top = row1[0] + fx * (row1[1] - row1[0]);
+    return bottom + fy * (top - bottom);
+}
+
+void app_invalidate_ray_cache(App* app) { app->ray_cache.generation++; }
+
+bool app_intersects_box(const float origin[3], const float dir[3], float* t, void* userdata) {
+    App* app = userdata;
+    return intersect_aabb(origin, dir, app->min_corner, app->max_corner, t);
+}
+
+// The float traversal can pick the wrong one of two adjacent triangles when the view is zoomed in
+// deeply, so re-test the hit triangle and the triangles that share a vertex with it in double
+// precision. Vertices are rebased to the ray origin so that their large common offset does not eat
+// into the precision.
+static float refine_hit(const App* app, part_ray ray, part_intersection isect) {
+    const float window = fmaxf(isect.t * 0.001f, 0.0001f);
+    const double origin[3] = {0, 0, 0};
+    const double dir[3] = {ray.dir[0], ray.dir[1], ray.dir[2]};
+    const float* points = app->mesh->points;
+    const uint16_t* hit = app->mesh->triangles + 3 * isect.triangle_index;
+    double best_t = -1;
+    for (int corner = 0; corner < 3; corner++) {
+        const uint32_t first = app->vertex_triangle_offsets[hit[corner]];
+        const uint32_t last = app->vertex_triangle_offsets[hit[corner] + 1];
+        for (uint32_t i = first; i < last; i++) {
+            const uint16_t* triangle = app->mesh->triangles + 3 * app->vertex_triangles[i];
+            double verts[3][3];
+            for (int k = 0; k < 3; k++) {
+                for (int axis = 0; axis < 3; axis++) {
+                    verts[k][axis] = (double)points[3 * triangle[k] + axis] - ray.org[axis];
+                }
+            }
+            double tri_t, u, v;
+            if (intersect_triangle_double(origin, dir, verts[0], verts[1], verts[2], &tri_t, &u,
+                                          &v) &&
+                tri_t >= fmax(isect.t - window, 0.0) && tri_t <= isect.t + window &&
+                (best_t < 0 || tri_t < best_t)) {
+                best_t = tri_t;
+            }
+        }
+    }
+    return best_t < 0 ? isect.t : (float)best_t;
+}
+
+bool app_trace_mesh(const App* app, part_ray ray, float* t, part_trace_stats* stats) {
+    if (stats) {
+        memset(stats, 0, sizeof(*stats));
+    }
+
+    // Most rays that miss the terrain also miss its bounds, so skip the BVH for those.
+    float box_t;
+    if (!intersect_aabb(ray.org, ray.dir, app->min_corner, app->max_corner, &box_t)) {
+        return false;
+    }
+    part_intersection isect;
+    if (!part_trace_with_stats(app->raytracer, ray, &isect, stats)) {
+        return false;
+    }
+    *t = refine_hit(app, ray, isect);
+    return true;
+}
+
+static bool trace_pick(part_ray ray, float* t, part_trace_stats* stats, void* userdata) {
+    return app_trace_mesh(userdata, ray, t, stats);
+}
+
 bool app_intersects_mesh(const float origin[3], const float dir[3], float* t, void* userdata) {
     App* app = userdata;
-    part_ray ray = {
+    RayCache* cache = &app->ray_cache;
+    const uint64_t start = stm_now();
+    trace_begin("raycast");
+    app->num_raycasts++;
+
+    const uint32_t key[6] = {
+        quantize_float(origin[0]), quantize_float(origin[1]), quantize_float(origin[2]),
+        quantize_float(dir[0]),    quantize_float(dir[1]),    quantize_float(dir[2]),
+    };
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < 6; i++) {
+        hash = (hash ^ key[i]) * 16777619u;
+    }
+    RayCacheEntry* entry = &cache->entries[hash % kRayCacheSize];
+    if (entry->generation == cache->generation && !memcmp(entry->key, key, sizeof(key))) {
+        cache->hits++;
+        *t = entry->t;
+        app->raycast_ticks += stm_since(start);
+        trace_end();
+        return entry->hit;
+    }
+    cache->misses++;
+
+    const part_ray ray = {
         .org = {origin[0], origin[1], origin[2]},
         .dir = {dir[0], dir[1], dir[2]},
         .min_t = 0.0f,
         .max_t = 9999.0f,
     };
-    part_intersection isect;
-    if (!part_trace(app->raytracer, ray, &isect)) {
-        return false;
+    if (app->ray_log) {
+        fwrite(&ray, sizeof(ray), 1, app->ray_log);
     }
-    *t = isect.t;
-    return true;
+    float hit_t = 0.0f;
+    const bool hit = app_trace_mesh(app, ray, &hit_t, NULL);
+
+    memcpy(entry->key, key, sizeof(key));
+    entry->generation = cache->generation;
+    entry->hit = hit;
+    entry->t = hit_t;
+
+    *t = entry->t;
+    app->raycast_ticks += stm_since(start);
+    trace_end();
+    return hit;
 }
 
 void app_init(App* app) {
     stm_setup();
-
-    sg_setup(&(sg_desc){
-        .mtl_device = sapp_metal_get_device(),
-        .mtl_renderpass_descriptor_cb = sapp_metal_get_renderpass_descriptor,
-        .mtl_drawable_cb = sapp_metal_get_drawable,
-    });
+    trace_set_thread_name("main");
+    trace_begin("app_init");
+    pthread_mutex_init(&app->command_mutex, NULL);
+    app->snapshots.back = 0;
+    app->snapshots.front = 1;
+    atomic_init(&app->snapshots.middle, 2);
 
     const uint64_t start_decode = stm_now();
     int width, height;
+    trace_begin("create_texture");
     create_texture(app, "extras/terrain/terrain.png", &width, &height);
+    trace_end();
     printf("Loaded %dx%d texture in %.0f ms\n", width, height,
            stm_ms(stm_diff(stm_now(), start_decode)));
 
     const uint64_t start_mesh = stm_now();
+    trace_begin("create_mesh");
     create_mesh(app, "extras/terrain/landmass.png");
+    trace_end();
     printf("Created terrain mesh in %.0f ms\n", stm_ms(stm_diff(stm_now(), start_mesh)));
 
     const uint64_t start_bvh = stm_now();
@@ -180,8 +354,22 @@ void app_init(App* app) {
         .triangles = app->mesh->triangles,
         .num_triangles = app->mesh->ntriangles,
     };
-    app->raytracer = part_create_context((part_config){.bin_size = 5}, mesh);
-    printf("Created raytracer BVH in %.0f ms\n", stm_ms(stm_diff(stm_now(), start_bvh)));
+    // Use the output of tune_bvh if it exists.
+    part_config bvh_config = {.bin_size = 5};
+    if (part_read_config(kBvhConfigFile, &bvh_config)) {
+        printf("Loaded BVH config from %s\n", kBvhConfigFile);
+    }
+    part_build_stats bvh_stats;
+    trace_begin("bvh_build");
+    app->raytracer = part_create_context(bvh_config, mesh, &bvh_stats);
+    trace_end();
+    app_invalidate_ray_cache(app);
+    app->picker = pick_create(trace_pick, app);
+    app_mark_dirty(app);
+    printf("Created raytracer BVH in %.0f ms (SAH cost %.1f)\n",
+           stm_ms(stm_diff(stm_now(), start_bvh)), part_get_sah_cost(app->raytracer));
+    printf("BVH depth = %d, leaves = %d, branches = %d\n", bvh_stats.max_tree_depth,
+           bvh_stats.num_leaf_nodes, bvh_stats.num_branch_nodes);
 
     const parcc_float extent[2] = {
         app->max_corner[0] - app->min_corner[0],
@@ -198,8 +386,8 @@ void app_init(App* app) {
 
     const parcc_properties props = {
         .mode = PARCC_ORBIT,
-        .viewport_width = sapp_width() - kSidebarWidth,
-        .viewport_height = sapp_height(),
+        .viewport_width = app->width - kSidebarWidth,
+        .viewport_height = app->height,
         .near_plane = kNearPlane,
         .far_plane = kFarPlane,
         .fov_orientation = PARCC_HORIZONTAL,
@@ -282,11 +470,206 @@ void app_init(App* app) {
         .layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT3,
         .layout.attrs[0].buffer_index = 0,
     });
+
+    // The first frame must not wait for the update thread.
+    app_update(app, app_get_seconds(app));
+    consume_snapshot(&app->snapshots);
+    if (app->threaded_update) {
+        app->updater = update_create(app);
+    }
+    trace_end();
 }
 
-void app_draw(App* app) {
-    const double seconds = stm_sec(stm_now());
+static void print_picks(App* app) {
+    PickResult results[kPickQueueSize];
+    const int count = pick_drain(app->picker, results, kPickQueueSize);
+    for (int i = 0; i < count; i++) {
+        const PickResult* result = &results[i];
+        printf("Clicked [%d, %d]", result->winx, result->winy);
+        if (result->hit) {
+            printf(" intersection at ");
+            float3_print(stdout, result->position);
+        }
+        const part_trace_stats* stats = &result->stats;
+        if (stats->rays > 0) {
+            printf(" (%llu aabb tests, %llu nodes, %llu leaves, %llu triangles)",
+                   (unsigned long long)stats->aabb_tests, (unsigned long long)stats->nodes_visited,
+                   (unsigned long long)stats->leaf_visits,
+                   (unsigned long long)stats->triangle_tests);
+        }
+        printf(" traced in %.2f ms, latency %.1f ms\n", result->trace_ms,
+               stm_ms(stm_diff(stm_now(), result->submit_time)));
+    }
+}
 
+// Keeps the eye above the terrain and away from steep slopes. The heightmap lookup catches the
+// common case of zooming into the ground, and the closest-point query catches eyes that are
+// above the ground but about to clip into a nearby slope. If either fails, the camera goes back
+// to the last frame that passed.
+static bool eye_is_safe(App* app) {
+    parcc_float eye[3], target[3], upward[3];
+    parcc_get_look_at(app->camera_controller, eye, target, upward);
+    const float point[3] = {eye[0], eye[1], eye[2]};
+    float closest[3];
+    return point[2] >= app_height_at(app, point[0], point[1]) + kMinEyeClearance &&
+           !part_closest_point(app->raytracer, point, kMinEyeClearance, closest, NULL);
+}
+
+// Keeps the eye above the terrain. When a move takes the eye below it, the move is cut short where
+// it meets the clearance rather than undone, so grabs and zooms slide along the surface. The last
+// safe frame is only restored if no part of the move is safe.
+static void clamp_eye(App* app) {
+    if (eye_is_safe(app)) {
+        app->safe_frame = parcc_get_current_frame(app->camera_controller);
+        app->has_safe_frame = true;
+        return;
+    }
+    if (!app->has_safe_frame) {
+        return;
+    }
+    const parcc_frame unsafe_frame = parcc_get_current_frame(app->camera_controller);
+    double safe_t = 0, unsafe_t = 1;
+    for (int i = 0; i < kEyeClampSteps; i++) {
+        const double t = 0.5 * (safe_t + unsafe_t);
+        parcc_goto_frame(app->camera_controller,
+                         parcc_interpolate_frames(app->safe_frame, unsafe_frame, t));
+        if (eye_is_safe(app)) {
+            safe_t = t;
+        } else {
+            unsafe_t = t;
+        }
+    }
+    if (safe_t > 0) {
+        app->safe_frame = parcc_interpolate_frames(app->safe_frame, unsafe_frame, safe_t);
+    }
+    parcc_goto_frame(app->camera_controller, app->safe_frame);
+}
+
+static void set_options(App* app, CameraOptions options) {
+    parcc_context* camera = app->camera_controller;
+    parcc_properties props;
+    parcc_get_properties(camera, &props);
+    if (props.mode != options.mode) {
+        goto_frame(app, parcc_get_home_frame(camera));
+        clear_frames(app);
+    }
+    props.mode = options.mode;
+    props.fov_orientation = options.fov_orientation;
+    props.map_constraint = options.map_constraint;
+    props.fov_degrees = options.fov_degrees;
+    props.raycast_function = options.raycast_mesh ? app_intersects_mesh : app_intersects_box;
+    parcc_set_properties(camera, &props);
+}
+
+static void apply_command(App* app, const CameraCommand* command) {
+    parcc_context* camera = app->camera_controller;
+    parcc_properties props;
+    switch (command->type) {
+        case CAMERA_GRAB_BEGIN:
+            parcc_grab_begin(camera, command->x, command->y, command->button);
+            break;
+        case CAMERA_GRAB_UPDATE:
+            parcc_grab_update(camera, command->x, command->y);
+            break;
+        case CAMERA_GRAB_END:
+            parcc_grab_end(camera);
+            break;
+        case CAMERA_ZOOM:
+            parcc_zoom(camera, command->x, command->y, command->zoom_delta);
+            break;
+        case CAMERA_PICK:
+            pick(app, command->x, command->y);
+            break;
+        case CAMERA_SELECT:
+            select_rect(app, command->x, command->y, command->x1, command->y1);
+            break;
+        case CAMERA_RESIZE:
+            parcc_get_properties(camera, &props);
+            props.viewport_width = command->x;
+            props.viewport_height = command->y;
+            parcc_set_properties(camera, &props);
+            break;
+        case CAMERA_SET_OPTIONS:
+            set_options(app, command->options);
+            break;
+        case CAMERA_GO_HOME:
+            goto_frame(app, parcc_get_home_frame(camera));
+            break;
+        case CAMERA_SAVE_FRAME:
+            save_frame(app, command->frame_index);
+            break;
+        case CAMERA_GOTO_FRAME:
+            if (app->has_frame[command->frame_index]) {
+                goto_frame(app, app->saved_frame[command->frame_index]);
+            }
+            break;
+    }
+}
+
+// Takes the queued commands under the lock, then applies them without it, so that their raycasts
+// never block the threads that send commands.
+static uint64_t apply_commands(App* app) {
+    CameraCommand commands[kMaxCameraCommands];
+    CommandQueue* queue = &app->commands;
+    pthread_mutex_lock(&app->command_mutex);
+    const int count = queue->count;
+    const uint64_t input_time = queue->input_time;
+    memcpy(commands, queue->items, sizeof(CameraCommand) * count);
+    queue->count = 0;
+    queue->input_time = 0;
+    pthread_mutex_unlock(&app->command_mutex);
+
+    for (int i = 0; i < count; i++) {
+        apply_command(app, &commands[i]);
+    }
+    return input_time;
+}
+
+void app_send_command(App* app, CameraCommand command) {
+    CommandQueue* queue = &app->commands;
+    pthread_mutex_lock(&app->command_mutex);
+    if (!queue->input_time) {
+        queue->input_time = stm_now();
+    }
+    CameraCommand* last = queue->count ? &queue->items[queue->count - 1] : NULL;
+    if (last && last->type == command.type && command.type == CAMERA_GRAB_UPDATE) {
+        last->x = command.x;
+        last->y = command.y;
+    } else if (last && last->type == command.type && command.type == CAMERA_ZOOM) {
+        last->x = command.x;
+        last->y = command.y;
+        last->zoom_delta += command.zoom_delta;
+    } else if (queue->count < kMaxCameraCommands) {
+        queue->items[queue->count++] = command;
+    } else {
+        printf("Dropped camera command %d, queue is full\n", command.type);
+    }
+    pthread_mutex_unlock(&app->command_mutex);
+    app_mark_dirty(app);
+}
+
+#define kSnapshotFresh (4)
+
+static void publish_snapshot(SnapshotBuffer* buffer) {
+    const int previous = atomic_exchange(&buffer->middle, buffer->back | kSnapshotFresh);
+    buffer->back = previous & 3;
+}
+
+// Returns true if a new snapshot was published since the last call.
+static bool consume_snapshot(SnapshotBuffer* buffer) {
+    if (!(atomic_load(&buffer->middle) & kSnapshotFresh)) {
+        return false;
+    }
+    buffer->front = atomic_exchange(&buffer->middle, buffer->front) & 3;
+    return true;
+}
+
+void app_update(App* app, double seconds) {
+    FrameSnapshot* snapshot = &app->snapshots.slots[app->snapshots.back];
+    trace_begin("app_update");
+    uint64_t stage_start = stm_now();
+
+    const uint64_t input_time = apply_commands(app);
     if (app->transition.enabled) {
         const CameraTransition anim = app->transition;
         const double elapsed = seconds - anim.start_time;
@@ -300,17 +683,95 @@ void app_draw(App* app) {
             parcc_frame frame = parcc_interpolate_frames(anim.source, anim.target, t);
             parcc_goto_frame(app->camera_controller, frame);
         }
+    } else {
+        clamp_eye(app);
     }
+    snapshot->update_ticks = stm_laptime(&stage_start);
+
+    // The map fields of gfx.uniforms are set once by app_init and never change.
+    Uniforms* uniforms = &snapshot->uniforms;
+    *uniforms = app->gfx.uniforms;
 
     float view[16];
-    parcc_get_matrices(app->camera_controller, app->gfx.uniforms.projection, view);
+    parcc_get_matrices(app->camera_controller, uniforms->projection, view);
 
     float model[16];
     float16_identity(model);
 
-    float16_multiply(app->gfx.uniforms.modelview, model, view);
-    float16_copy(app->gfx.uniforms.inverse_mv, app->gfx.uniforms.modelview);
-    float16_invert(app->gfx.uniforms.inverse_mv);
+    float16_multiply(uniforms->modelview, model, view);
+    float16_copy(uniforms->inverse_mv, uniforms->modelview);
+    float16_invert(uniforms->inverse_mv);
+
+    parcc_float eye[3], target[3], upward[3];
+    parcc_get_look_at(app->camera_controller, eye, target, upward);
+    float3_set(snapshot->eye, eye[0], eye[1], eye[2]);
+    snapshot->has_frame[0] = app->has_frame[0];
+    snapshot->has_frame[1] = app->has_frame[1];
+    snapshot->num_selected = app->num_selected;
+    snapshot->transition_enabled = app->transition.enabled;
+    snapshot->input_time = input_time;
+    snapshot->matrices_ticks = stm_laptime(&stage_start);
+
+    publish_snapshot(&app->snapshots);
+    trace_end();
+}
+
+static void record_perf(App* app) {
+    AppTimings* timings = &app->timings;
+    PerfHistory* perf = &app->perf;
+
+    const uint64_t raycasts = atomic_load(&app->num_raycasts);
+    const uint64_t raycast_ticks = atomic_load(&app->raycast_ticks);
+    timings->raycasts = (uint32_t)(raycasts - perf->last_raycasts);
+    timings->raycast = raycast_ticks - perf->last_raycast_ticks;
+    perf->last_raycasts = raycasts;
+    perf->last_raycast_ticks = raycast_ticks;
+
+    perf->draw_ms[perf->head] = stm_ms(timings->draw);
+    perf->raycasts[perf->head] = timings->raycasts;
+    perf->head = (perf->head + 1) % kPerfHistorySize;
+    perf->count = IMIN(perf->count + 1, kPerfHistorySize);
+}
+
+bool app_draw(App* app) {
+    const uint64_t draw_start = stm_now();
+    const double seconds = app_get_seconds(app);
+    SnapshotBuffer* snapshots = &app->snapshots;
+
+    print_picks(app);
+
+    // Pick up whatever the update thread published since the last frame. Its effect on the screen
+    // can arrive a frame or two after the input that caused it.
+    bool fresh = false;
+    if (app->updater) {
+        fresh = consume_snapshot(snapshots);
+        if (fresh && snapshots->slots[snapshots->front].input_time) {
+            app_mark_dirty(app);
+        }
+    }
+
+    // Nothing can change on screen without input or a running transition.
+    if (snapshots->slots[snapshots->front].transition_enabled) {
+        app_mark_dirty(app);
+    }
+    if (app->dirty_frames == 0) {
+        return false;
+    }
+    app->dirty_frames--;
+    trace_begin("app_draw");
+
+    if (app->updater) {
+        update_request(app->updater, seconds);
+    } else {
+        app_update(app, seconds);
+        fresh = consume_snapshot(snapshots);
+    }
+    const FrameSnapshot* snapshot = &snapshots->slots[snapshots->front];
+
+    AppTimings* timings = &app->timings;
+    timings->update = fresh ? snapshot->update_ticks : 0;
+    timings->matrices = fresh ? snapshot->matrices_ticks : 0;
+    uint64_t stage_start = stm_now();
 
     const sg_pass_action pass_action = {
         .colors[0].action = SG_ACTION_CLEAR,
@@ -319,46 +780,230 @@ void app_draw(App* app) {
         .depth.val = 1.0f,
     };
 
-    const float vp_width = sapp_width() - kSidebarWidth;
-    const float vp_height = sapp_height();
+    const float vp_width = app->width - kSidebarWidth;
+    const float vp_height = app->height;
 
-    sg_begin_default_pass(&pass_action, sapp_width(), sapp_height());
+    sg_begin_default_pass(&pass_action, app->width, app->height);
     sg_apply_viewport(kSidebarWidth, 0, vp_width, vp_height, false);
     sg_apply_pipeline(app->gfx.terrain_pipeline);
     sg_apply_bindings(&app->gfx.terrain_bindings);
-    sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, &app->gfx.uniforms, sizeof(Uniforms));
+    sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, &snapshot->uniforms, sizeof(Uniforms));
     sg_draw(0, app->gfx.num_elements, 1);
 
     sg_apply_pipeline(app->gfx.ocean_pipeline);
     sg_apply_bindings(&app->gfx.ocean_bindings);
-    sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, &app->gfx.uniforms, sizeof(Uniforms));
+    sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, &snapshot->uniforms, sizeof(Uniforms));
     sg_draw(0, 6, 1);
+    timings->scene = stm_laptime(&stage_start);
 
-    sg_apply_viewport(0, 0, sapp_width(), vp_height, false);
+    sg_apply_viewport(0, 0, app->width, vp_height, false);
     gui_draw(app->gui);
+    timings->gui = stm_laptime(&stage_start);
 
     sg_end_pass();
     sg_commit();
+    timings->commit = stm_laptime(&stage_start);
+    timings->input_latency = fresh && snapshot->input_time ? stm_since(snapshot->input_time) : 0;
+    timings->triangles = app->gfx.num_elements / 3 + 2;
+    timings->draw = stm_since(draw_start);
+    record_perf(app);
+    trace_end();
+    return true;
+}
+
+void app_shutdown(App* app) {
+    update_destroy(app->updater);
+    pick_destroy(app->picker);
+    pthread_mutex_destroy(&app->command_mutex);
+    gui_destroy(app->gui);
+    parcc_destroy_context(app->camera_controller);
+    part_destroy_context(app->raytracer);
+    par_msquares_free(app->meshes);
+    free(app->selection);
+    free(app->heightmap.data);
+    free(app->vertex_triangle_offsets);
+    free(app->vertex_triangles);
+}
+
+void app_mark_dirty(App* app) { app->dirty_frames = kDirtyFrames; }
+
+double app_get_seconds(const App* app) {
+    return app->use_virtual_clock ? app->virtual_seconds : stm_sec(stm_now());
 }
 
-void app_goto_frame(App* app, parcc_frame goal) {
+void app_handle_event(App* app, const sapp_event* event) {
+    // Any event can move the camera or change the GUI, including hover highlights.
+    app_mark_dirty(app);
+    if (gui_handle(app->gui, event)) {
+        return;
+    }
+    const float vpheight = app->height;
+    const int winx = (event->mouse_x - kSidebarWidth);
+    const int winy = vpheight - 1 - event->mouse_y;
+    CameraCommand command = {.x = winx, .y = winy};
+
+    switch (event->type) {
+        case SAPP_EVENTTYPE_RESIZED:
+            app->width = event->window_width;
+            app->height = event->window_height;
+            command.type = CAMERA_RESIZE;
+            command.x = app->width - kSidebarWidth;
+            command.y = app->height;
+            app_send_command(app, command);
+            break;
+        case SAPP_EVENTTYPE_MOUSE_DOWN:
+            app->mouse_down_pos[0] = winx;
+            app->mouse_down_pos[1] = winy;
+            // Shift-drag selects a rectangle instead of moving the camera.
+            app->selecting = event->modifiers & SAPP_MODIFIER_SHIFT;
+            if (!app->selecting) {
+                command.type = CAMERA_GRAB_BEGIN;
+                command.button = event->mouse_button;
+                app_send_command(app, command);
+            }
+            break;
+        case SAPP_EVENTTYPE_MOUSE_UP:
+            if (app->selecting) {
+                command.type = CAMERA_SELECT;
+                command.x = app->mouse_down_pos[0];
+                command.y = app->mouse_down_pos[1];
+                command.x1 = winx;
+                command.y1 = winy;
+                app_send_command(app, command);
+                app->selecting = false;
+                break;
+            }
+            command.type = CAMERA_GRAB_END;
+            app_send_command(app, command);
+            if (winx == app->mouse_down_pos[0] && winy == app->mouse_down_pos[1]) {
+                command.type = CAMERA_PICK;
+                app_send_command(app, command);
+            }
+            break;
+        case SAPP_EVENTTYPE_MOUSE_SCROLL:
+            command.type = CAMERA_ZOOM;
+            command.zoom_delta = event->scroll_y;
+            app_send_command(app, command);
+            break;
+        case SAPP_EVENTTYPE_MOUSE_MOVE:
+            if (!app->selecting) {
+                command.type = CAMERA_GRAB_UPDATE;
+                app_send_command(app, command);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static void goto_frame(App* app, parcc_frame goal) {
     parcc_properties props;
     parcc_get_properties(app->camera_controller, &props);
     if (app->transition.enabled) {
         return;
     }
-    app->transition.start_time = stm_sec(stm_now());
+    app->transition.start_time = app_get_seconds(app);
     app->transition.source = parcc_get_current_frame(app->camera_controller);
     app->transition.target = goal;
     app->transition.enabled = true;
 }
 
-void app_save_frame(App* app, int index) {
+static void save_frame(App* app, int index) {
     app->saved_frame[index] = parcc_get_current_frame(app->camera_controller);
     app->has_frame[index] = true;
 }
 
-void app_clear_frames(App* app) {
+static void clear_frames(App* app) {
     app->has_frame[0] = false;
     app->has_frame[1] = false;
 }
+
+static void get_view_projection(App* app, float view_projection[16]) {
+    float view[16];
+    float projection[16];
+    parcc_get_matrices(app->camera_controller, projection, view);
+    float16_multiply(view_projection, view, projection);
+}
+
+static void window_to_ndc(const App* app, float ndc[2], float winx, float winy) {
+    parcc_properties props;
+    parcc_get_properties(app->camera_controller, &props);
+    const float vp_width = props.viewport_width;
+    const float vp_height = props.viewport_height;
+    ndc[0] = 2.0f * winx / vp_width - 1.0f;
+    ndc[1] = 2.0f * winy / vp_height - 1.0f;
+}
+
+// Queues a raycast through the given viewport pixel. The result is printed on a later frame.
+static void pick(App* app, int winx, int winy) {
+    float inverse_vp[16];
+    get_view_projection(app, inverse_vp);
+    float16_invert(inverse_vp);
+
+    float ndc[2];
+    window_to_ndc(app, ndc, winx + 0.5f, winy + 0.5f);
+    const float ndc_x = ndc[0];
+    const float ndc_y = ndc[1];
+
+    float near_point[4] = {ndc_x, ndc_y, -1, 1};
+    float far_point[4] = {ndc_x, ndc_y, 1, 1};
+    float16_transform(near_point, inverse_vp);
+    float16_transform(far_point, inverse_vp);
+    float3_scale(near_point, 1.0f / near_point[3]);
+    float3_scale(far_point, 1.0f / far_point[3]);
+
+    part_ray ray = {.min_t = 0.0f, .max_t = 1.0f};
+    float3_copy(ray.org, near_point);
+    float3_subtract(ray.dir, far_point, near_point);
+
+    // Hit whatever the camera controller hits. The box is a single slab test, so it is traced
+    // right here rather than on the worker.
+    parcc_properties props;
+    parcc_get_properties(app->camera_controller, &props);
+    if (props.raycast_function != app_intersects_mesh) {
+        printf("Clicked [%d, %d]", winx, winy);
+        float t;
+        if (props.raycast_function(ray.org, ray.dir, &t, props.raycast_userdata)) {
+            float position[3];
+            float3_scale(ray.dir, t);
+            float3_add(position, ray.org, ray.dir);
+            printf(" intersection at ");
+            float3_print(stdout, position);
+        }
+        printf("\n");
+        return;
+    }
+    if (!pick_submit(app->picker, ray, winx, winy)) {
+        printf("Dropped pick at [%d, %d], queue is full\n", winx, winy);
+    }
+}
+
+// Finds the terrain triangles inside the frustum of a viewport rectangle, given by two corners.
+static void select_rect(App* app, int winx0, int winy0, int winx1, int winy1) {
+    float vp[16];
+    get_view_projection(app, vp);
+
+    float lower[2], upper[2];
+    window_to_ndc(app, lower, IMIN(winx0, winx1), IMIN(winy0, winy1));
+    window_to_ndc(app, upper, IMAX(winx0, winx1) + 1, IMAX(winy0, winy1) + 1);
+
+    // Each side of the sub-frustum bounds one clip coordinate against w, e.g. x >= lower.x * w.
+    float planes[6][4];
+    for (int col = 0; col < 4; col++) {
+        const float x = vp[col * 4 + 0], y = vp[col * 4 + 1];
+        const float z = vp[col * 4 + 2], w = vp[col * 4 + 3];
+        planes[0][col] = x - lower[0] * w;
+        planes[1][col] = upper[0] * w - x;
+        planes[2][col] = y - lower[1] * w;
+        planes[3][col] = upper[1] * w - y;
+        planes[4][col] = z + w;
+        planes[5][col] = w - z;
+    }
+
+    if (!app->selection) {
+        app->selection = malloc(sizeof(uint32_t) * app->mesh->ntriangles);
+    }
+    app->num_selected = part_query_frustum(app->raytracer, &planes[0][0], 6, app->selection,
+                                           app->mesh->ntriangles);
+    printf("Selected %zu triangles\n", app->num_selected);
+}
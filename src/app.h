@@ -1,5 +1,9 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
 #include <par/par_camera_control.h>
 #include <par/par_msquares.h>
 
@@ -8,10 +12,25 @@
 #include <nanort/nanort_c.h>
 
 #include "gui.h"
+#include "pick.h"
+#include "update.h"
 
 #define kSidebarWidth (300)
 #define kNearPlane (0.001)
 #define kFarPlane (100)
+#define kBvhConfigFile "extras/terrain/bvh.cfg"
+#define kRayCacheSize (64)
+#define kMinEyeClearance (0.002)
+#define kMaxCameraCommands (64)
+
+// Bisection steps used to find how much of a move keeps the eye above the terrain.
+#define kEyeClampSteps (8)
+
+// Frames to draw after anything changes, enough to refresh every buffer in the swap chain.
+#define kDirtyFrames (3)
+
+// Drawn frames remembered by the performance panel.
+#define kPerfHistorySize (128)
 
 typedef enum { VISUAL_MODE_2D, VISUAL_MODE_3D } VisualMode;
 
@@ -41,25 +60,216 @@ typedef struct {
     double start_time;
 } CameraTransition;
 
+// Direct-mapped cache of recent pick results, keyed on the quantized ray. An entry is valid only
+// if its generation matches the cache's, so bumping the generation invalidates everything.
+typedef struct {
+    uint32_t key[6];
+    uint32_t generation;
+    bool hit;
+    float t;
+} RayCacheEntry;
+
+typedef struct {
+    RayCacheEntry entries[kRayCacheSize];
+    uint32_t generation;
+    // Read by the performance panel and the bench while raycasts run on the update thread.
+    atomic_uint hits;
+    atomic_uint misses;
+} RayCache;
+
+// The grayscale heights that the terrain mesh was built from. par_msquares scales both axes by
+// the larger dimension; its row order is detected from the mesh when the heightmap is loaded.
+typedef struct {
+    float* data;
+    int width;
+    int height;
+    float scale;
+    bool flip_y;
+} Heightmap;
+
+// CPU time spent in each stage of the last drawn frame, in sokol_time ticks. The update and
+// matrices stages come from the app_update that produced the frame's snapshot.
+typedef struct {
+    uint64_t update;
+    uint64_t matrices;
+    uint64_t scene;
+    uint64_t gui;
+    uint64_t commit;
+    // Time from the oldest input shown in this frame to the end of the frame, or 0 if none.
+    uint64_t input_latency;
+    // The whole of app_draw, and the two halves of gui_draw.
+    uint64_t draw;
+    uint64_t render_ui;
+    uint64_t define_ui;
+    // Raycasts since the previous drawn frame, on any thread, and the time spent in them.
+    uint64_t raycast;
+    uint32_t raycasts;
+    uint32_t triangles;
+} AppTimings;
+
+// Fixed-size ring buffers of recent drawn frames for the performance panel. The newest sample is
+// at head - 1.
+typedef struct {
+    float draw_ms[kPerfHistorySize];
+    uint32_t raycasts[kPerfHistorySize];
+    int head;
+    int count;
+    uint64_t last_raycasts;
+    uint64_t last_raycast_ticks;
+} PerfHistory;
+
+// Everything that app_draw and the sidebar need from the camera, published by app_update.
+typedef struct {
+    Uniforms uniforms;
+    bool transition_enabled;
+    float eye[3];
+    bool has_frame[2];
+    size_t num_selected;
+    uint64_t input_time;
+    uint64_t update_ticks;
+    uint64_t matrices_ticks;
+} FrameSnapshot;
+
+// Lock-free single-producer single-consumer triple buffer. The producer fills the back slot and
+// swaps it with the middle one. The consumer swaps the middle slot with the front one, but only if
+// the middle slot holds a newer snapshot. Neither side ever waits for the other.
+typedef struct {
+    FrameSnapshot slots[3];
+    int back;
+    int front;
+    atomic_int middle;
+} SnapshotBuffer;
+
+// The camera settings that the sidebar edits.
+typedef struct {
+    parcc_mode mode;
+    parcc_fov fov_orientation;
+    parcc_constraint map_constraint;
+    float fov_degrees;
+    bool raycast_mesh;
+} CameraOptions;
+
+typedef enum {
+    // Input from the viewport. x and y are window coordinates in the viewport.
+    CAMERA_GRAB_BEGIN,
+    CAMERA_GRAB_UPDATE,
+    CAMERA_GRAB_END,
+    CAMERA_ZOOM,
+    CAMERA_PICK,
+    // Selects the rectangle between (x, y) and (x1, y1).
+    CAMERA_SELECT,
+    // x and y are the new viewport size.
+    CAMERA_RESIZE,
+    // Edits from the sidebar.
+    CAMERA_SET_OPTIONS,
+    CAMERA_GO_HOME,
+    CAMERA_SAVE_FRAME,
+    CAMERA_GOTO_FRAME,
+} CameraCommandType;
+
+typedef struct {
+    CameraCommandType type;
+    int x;
+    int y;
+    int x1;
+    int y1;
+    int button;
+    float zoom_delta;
+    int frame_index;
+    CameraOptions options;
+} CameraCommand;
+
+// Camera commands that arrived since the last update, in order. Only the thread that runs
+// app_update touches the camera controller, so everything else sends it commands. High-rate mice
+// can deliver several moves or scrolls per frame, and each one may raycast the terrain, so a run of
+// them is merged into one command. input_time is when the oldest command that the next update will
+// apply arrived.
+typedef struct {
+    CameraCommand items[kMaxCameraCommands];
+    int count;
+    uint64_t input_time;
+} CommandQueue;
+
 typedef struct App {
+    int width;
+    int height;
     VisualMode visual_mode;
     CameraTransition transition;
     parcc_context* camera_controller;
     GraphicsState gfx;
     Gui* gui;
+    par_msquares_meshlist* meshes;
     par_msquares_mesh const* mesh;
+    uint32_t* vertex_triangle_offsets;
+    uint32_t* vertex_triangles;
     part_context* raytracer;
     bool has_frame[2];
     parcc_frame saved_frame[2];
     float min_corner[3];
     float max_corner[3];
+    FILE* ray_log;
+    RayCache ray_cache;
+    PickService* picker;
+    Heightmap heightmap;
+    bool has_safe_frame;
+    parcc_frame safe_frame;
+    uint32_t* selection;
+    size_t num_selected;
+    int dirty_frames;
+    AppTimings timings;
+    float mouse_down_pos[2];
+    bool selecting;
+    CommandQueue commands;
+    bool use_virtual_clock;
+    double virtual_seconds;
+    // Raycasts on any thread, and the time spent in them.
+    atomic_uint_fast64_t num_raycasts;
+    atomic_uint_fast64_t raycast_ticks;
+    PerfHistory perf;
+    bool threaded_update;
+    UpdateThread* updater;
+    // Guards the command queue only. It is never held while the camera controller runs.
+    pthread_mutex_t command_mutex;
+    SnapshotBuffer snapshots;
 } App;
 
+// The window size must be set and sokol_gfx must be set up before calling app_init. If
+// threaded_update is set, camera updates run on their own thread.
 void app_init(App* app);
-void app_draw(App* app);
 
-void app_goto_frame(App* app, parcc_frame goal);
-void app_save_frame(App* app, int index);
-void app_clear_frames(App* app);
+// Returns false if the frame was skipped because nothing changed since the last one.
+bool app_draw(App* app);
+void app_shutdown(App* app);
+
+// Applies queued camera commands, advances camera transitions and publishes a new FrameSnapshot.
+// app_draw calls this itself, unless threaded_update is set, in which case the update thread does.
+void app_update(App* app, double seconds);
+
+// Queues a command for the next app_update. Once app_init returns, this is the only way for other
+// code to change the camera.
+void app_send_command(App* app, CameraCommand command);
+
+// Feeds a window event to the GUI, then to the camera controller if the GUI did not take it.
+void app_handle_event(App* app, const sapp_event* event);
+
+// Seconds on the clock that drives camera transitions. This is the system clock unless
+// use_virtual_clock is set, in which case it is virtual_seconds.
+double app_get_seconds(const App* app);
+
+// Requests a redraw. app_draw skips frames entirely until this is called.
+void app_mark_dirty(App* app);
+
+// Returns the terrain height at the given world-space position in O(1) by bilinearly
+// interpolating the heightmap. Positions outside the map are clamped to its edge.
+float app_height_at(const App* app, float x, float y);
+
+// Must be called whenever the mesh geometry changes, e.g. after part_update_vertices.
+void app_invalidate_ray_cache(App* app);
+
+// Intersects the terrain the way app_intersects_mesh does, with the bounding box test first and
+// the double-precision refinement of the hit, but without the ray cache. It only reads data that
+// is fixed after app_init, so any thread may call it. stats is optional.
+bool app_trace_mesh(const App* app, part_ray ray, float* t, part_trace_stats* stats);
 
+bool app_intersects_box(const float origin[3], const float dir[3], float* t, void* userdata);
 bool app_intersects_mesh(const float origin[3], const float dir[3], float* t, void* userdata);
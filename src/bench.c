@@ -0,0 +1,280 @@
+// Headless benchmark for the load and frame paths, for machines without a display.
+//
+// Runs app_init and then a scripted sequence of frames against the sokol dummy backend: a zoom
+// toward the center, an orbit drag, then a transition back to the home frame. Prints the mean
+// and worst CPU time of each stage of app_draw.
+//
+// With --replay, feeds back an input log recorded by running the app with "record_input=<file>"
+// instead. The replay runs on a virtual clock, so two builds see the same camera motion, and it
+// reports percentiles of the CPU time per frame along with raycast counts. Frames run back to
+// back unless --realtime is given, which paces them at the frame rate of the virtual clock like a
+// real display. Pacing makes input latency meaningful, but the replay then takes as long as the
+// recording did.
+//
+// Only frames that app_draw actually drew count toward the statistics. Skipped frames are
+// reported separately.
+//
+// With --threaded, camera updates run on their own thread, as with "threaded_update=true" in the
+// app. Compare input latency and jitter with and without it.
+//
+// With --trace, writes the timeline of app_init and every frame as Chrome trace-event JSON.
+//
+// Usage: camera_demo_bench [--threaded] [--trace <file>] [num_frames]
+//        camera_demo_bench [--threaded] [--trace <file>] [--realtime] --replay <file>
+
+#define _POSIX_C_SOURCE 199309L
+#define PAR_CAMERA_CONTROL_IMPLEMENTATION
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sokol/sokol_gfx.h>
+#include <sokol/sokol_time.h>
+
+#include "app.h"
+#include "replay.h"
+#include "trace.h"
+
+#define kNumStages (5)
+
+// Frames to keep drawing after the last recorded event while a transition finishes.
+#define kMaxReplayTailFrames (600)
+
+typedef struct {
+    double* frame_ms;
+    int num_frames;
+    int num_skipped;
+    double stage_total_ms[kNumStages];
+    double stage_max_ms[kNumStages];
+    double latency_total_ms;
+    double latency_max_ms;
+    int num_latencies;
+} FrameStats;
+
+static void send_mouse(App* app, sapp_event_type type, int winx, int winy, float scroll_y) {
+    const sapp_event event = {
+        .type = type,
+        .mouse_button = SAPP_MOUSEBUTTON_LEFT,
+        .mouse_x = winx + kSidebarWidth,
+        .mouse_y = app->height - 1 - winy,
+        .scroll_y = scroll_y,
+    };
+    app_handle_event(app, &event);
+}
+
+static void script_input(App* app, int frame, int num_frames) {
+    const int center_x = (app->width - kSidebarWidth) / 2;
+    const int center_y = app->height / 2;
+    const int phase = 3 * frame / num_frames;
+    const int phase_start = phase * num_frames / 3;
+    if (phase == 0) {
+        send_mouse(app, SAPP_EVENTTYPE_MOUSE_SCROLL, center_x, center_y, 0.5f);
+    } else if (phase == 1) {
+        if (frame == phase_start) {
+            send_mouse(app, SAPP_EVENTTYPE_MOUSE_DOWN, center_x, center_y, 0);
+        }
+        send_mouse(app, SAPP_EVENTTYPE_MOUSE_MOVE, center_x + (frame - phase_start), center_y, 0);
+    } else if (frame == phase_start) {
+        send_mouse(app, SAPP_EVENTTYPE_MOUSE_UP, center_x + num_frames / 3, center_y, 0);
+        app_send_command(app, (CameraCommand){.type = CAMERA_GO_HOME});
+    }
+    app_mark_dirty(app);
+}
+
+// The timings in app are only current if app_draw drew the frame.
+static void add_frame(FrameStats* stats, const App* app, bool drawn, double frame_ms) {
+    if (!drawn) {
+        stats->num_skipped++;
+        return;
+    }
+    stats->frame_ms[stats->num_frames++] = frame_ms;
+    const AppTimings* t = &app->timings;
+    const uint64_t stages[kNumStages] = {t->update, t->matrices, t->scene, t->gui, t->commit};
+    for (int i = 0; i < kNumStages; i++) {
+        const double ms = stm_ms(stages[i]);
+        stats->stage_total_ms[i] += ms;
+        stats->stage_max_ms[i] = ms > stats->stage_max_ms[i] ? ms : stats->stage_max_ms[i];
+    }
+    if (t->input_latency) {
+        const double ms = stm_ms(t->input_latency);
+        stats->latency_total_ms += ms;
+        stats->latency_max_ms = ms > stats->latency_max_ms ? ms : stats->latency_max_ms;
+        stats->num_latencies++;
+    }
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const double* sorted, int count, double p) {
+    const int index = (int)(p * count);
+    return sorted[index < count ? index : count - 1];
+}
+
+static void print_stats(FrameStats* stats) {
+    const char* names[kNumStages] = {"update", "matrices", "scene", "gui", "commit"};
+    const int count = stats->num_frames;
+    printf("%d frames drawn, %d skipped with nothing to draw\n", count, stats->num_skipped);
+    if (count == 0) {
+        return;
+    }
+    printf("Mean / max CPU ms per stage:\n");
+    for (int i = 0; i < kNumStages; i++) {
+        printf("  %-9s %8.4f / %8.4f\n", names[i], stats->stage_total_ms[i] / count,
+               stats->stage_max_ms[i]);
+    }
+
+    double mean = 0;
+    for (int i = 0; i < count; i++) {
+        mean += stats->frame_ms[i] / count;
+    }
+    double variance = 0;
+    for (int i = 0; i < count; i++) {
+        variance += (stats->frame_ms[i] - mean) * (stats->frame_ms[i] - mean) / count;
+    }
+    qsort(stats->frame_ms, count, sizeof(double), compare_doubles);
+    printf("CPU ms per frame: mean %.4f  p50 %.4f  p90 %.4f  p99 %.4f  max %.4f\n", mean,
+           percentile(stats->frame_ms, count, 0.5), percentile(stats->frame_ms, count, 0.9),
+           percentile(stats->frame_ms, count, 0.99), stats->frame_ms[count - 1]);
+    printf("Jitter (standard deviation of CPU ms per frame): %.4f\n", sqrt(variance));
+    if (stats->num_latencies > 0) {
+        printf("Input latency: mean %.2f ms, max %.2f ms over %d frames\n",
+               stats->latency_total_ms / stats->num_latencies, stats->latency_max_ms,
+               stats->num_latencies);
+    }
+}
+
+static void sleep_until(uint64_t start, double deadline_secs) {
+    const double secs = deadline_secs - stm_sec(stm_since(start));
+    if (secs > 0) {
+        const struct timespec duration = {(time_t)secs, (long)(fmod(secs, 1.0) * 1e9)};
+        nanosleep(&duration, NULL);
+    }
+}
+
+static int run_replay(App* app, const char* filename, bool realtime) {
+    ReplayLog log;
+    if (!replay_load(filename, &log)) {
+        fprintf(stderr, "Unable to load %s\n", filename);
+        return 1;
+    }
+    if (log.width != app->width || log.height != app->height) {
+        sapp_event resize = {
+            .type = SAPP_EVENTTYPE_RESIZED,
+            .window_width = log.width,
+            .window_height = log.height,
+        };
+        app_handle_event(app, &resize);
+    }
+    app->use_virtual_clock = true;
+
+    const uint32_t last_frame = log.num_events ? log.events[log.num_events - 1].frame : 0;
+    const int max_frames = last_frame + 1 + kMaxReplayTailFrames;
+    FrameStats stats = {.frame_ms = malloc(sizeof(double) * max_frames)};
+    uint64_t total_raycasts = 0, max_raycasts = 0;
+    uint64_t total_traces = 0, max_traces = 0;
+    uint64_t raycasts = atomic_load(&app->num_raycasts);
+    uint64_t traces = atomic_load(&app->ray_cache.misses);
+    size_t next_event = 0;
+    const uint64_t replay_start = stm_now();
+    for (uint32_t frame = 0; frame < (uint32_t)max_frames; frame++) {
+        const SnapshotBuffer* snapshots = &app->snapshots;
+        const bool busy =
+            snapshots->slots[snapshots->front].transition_enabled || app->dirty_frames > 0;
+        if (frame > last_frame && !busy) {
+            break;
+        }
+        if (realtime) {
+            sleep_until(replay_start, frame * kReplayFrameSeconds);
+        }
+        app->virtual_seconds = frame * kReplayFrameSeconds;
+        const uint64_t start = stm_now();
+        for (; next_event < log.num_events && log.events[next_event].frame <= frame;
+             next_event++) {
+            sapp_event event;
+            replay_get_event(&log.events[next_event], &event);
+            app_handle_event(app, &event);
+        }
+        const bool drawn = app_draw(app);
+        add_frame(&stats, app, drawn, stm_ms(stm_diff(stm_now(), start)));
+
+        // With threaded updates, raycasts land on the update thread, hence the atomic counters.
+        const uint64_t frame_raycasts = atomic_load(&app->num_raycasts) - raycasts;
+        const uint64_t frame_traces = atomic_load(&app->ray_cache.misses) - traces;
+        raycasts += frame_raycasts;
+        traces += frame_traces;
+        total_raycasts += frame_raycasts;
+        total_traces += frame_traces;
+        max_raycasts = frame_raycasts > max_raycasts ? frame_raycasts : max_raycasts;
+        max_traces = frame_traces > max_traces ? frame_traces : max_traces;
+    }
+
+    const int num_frames = stats.num_frames + stats.num_skipped;
+    const double recorded_secs = log.num_events ? log.events[log.num_events - 1].seconds : 0;
+    printf("Replayed %zu events (recorded over %.1f s)\n", log.num_events, recorded_secs);
+    print_stats(&stats);
+    printf("Raycasts: %llu total, %.2f per frame, %llu max\n",
+           (unsigned long long)total_raycasts, (double)total_raycasts / num_frames,
+           (unsigned long long)max_raycasts);
+    printf("BVH traces: %llu total, %.2f per frame, %llu max\n", (unsigned long long)total_traces,
+           (double)total_traces / num_frames, (unsigned long long)max_traces);
+
+    free(stats.frame_ms);
+    replay_free(&log);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    bool threaded = false;
+    bool realtime = false;
+    const char* replay_file = NULL;
+    const char* trace_file = NULL;
+    int num_frames = 600;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--threaded")) {
+            threaded = true;
+        } else if (!strcmp(argv[i], "--realtime")) {
+            realtime = true;
+        } else if (!strcmp(argv[i], "--replay") && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace_file = argv[++i];
+        } else {
+            num_frames = atoi(argv[i]);
+        }
+    }
+
+    stm_setup();
+    const uint64_t start_init = stm_now();
+    sg_setup(&(sg_desc){0});
+    App app = {.width = 1280, .height = 720, .threaded_update = threaded};
+    app_init(&app);
+    printf("app_init took %.1f ms\n", stm_ms(stm_diff(stm_now(), start_init)));
+
+    int result = 0;
+    if (replay_file) {
+        result = run_replay(&app, replay_file, realtime);
+    } else {
+        FrameStats stats = {.frame_ms = malloc(sizeof(double) * num_frames)};
+        for (int frame = 0; frame < num_frames; frame++) {
+            const uint64_t start = stm_now();
+            script_input(&app, frame, num_frames);
+            const bool drawn = app_draw(&app);
+            add_frame(&stats, &app, drawn, stm_ms(stm_diff(stm_now(), start)));
+        }
+        print_stats(&stats);
+        free(stats.frame_ms);
+    }
+
+    app_shutdown(&app);
+    if (trace_file) {
+        trace_dump(trace_file);
+    }
+    sg_shutdown();
+    return result;
+}
@@ -2,76 +2,85 @@
 #include <stdio.h>
 
 #include <sokol/sokol_app.h>
+#include <sokol/sokol_args.h>
+#include <sokol/sokol_gfx.h>
+#include <sokol/sokol_time.h>
 
 #include "app.h"
+#include "replay.h"
+#include "trace.h"
 #include "vec_float.h"
 
 static App app = {0};
 
+static FILE* input_log = NULL;
+static uint64_t record_start = 0;
+static const char* trace_file = "trace.json";
+
 static void handler(const sapp_event* event) {
-    static float mouse_down_pos[2] = {0};
-    if (gui_handle(app.gui, event)) {
+    if (input_log) {
+        replay_record(input_log, stm_sec(stm_since(record_start)), event);
+    }
+    if (event->type == SAPP_EVENTTYPE_CHAR && event->char_code == 27) {
+        sapp_request_quit();
         return;
     }
-    const float vpwidth = sapp_width() - kSidebarWidth;
-    const float vpheight = sapp_height();
-    const int winx = (event->mouse_x - kSidebarWidth);
-    const int winy = vpheight - 1 - event->mouse_y;
-    parcc_properties props;
-    switch (event->type) {
-        case SAPP_EVENTTYPE_RESIZED: {
-            parcc_get_properties(app.camera_controller, &props);
-            props.viewport_width = vpwidth;
-            props.viewport_height = vpheight;
-            parcc_set_properties(app.camera_controller, &props);
-            break;
-        }
-        case SAPP_EVENTTYPE_MOUSE_DOWN: {
-            mouse_down_pos[0] = winx;
-            mouse_down_pos[1] = winy;
-            parcc_grab_begin(app.camera_controller, winx, winy, event->mouse_button);
-            break;
-        }
-        case SAPP_EVENTTYPE_MOUSE_UP:
-            parcc_grab_end(app.camera_controller);
-            if (winx == mouse_down_pos[0] && winy == mouse_down_pos[1]) {
-                printf("Clicked [%d, %d]", winx, winy);
-                float world_space[3];
-                if (parcc_raycast(app.camera_controller, winx, winy, world_space)) {
-                    printf(" intersection at ");
-                    float3_print(stdout, world_space);
-                }
-                printf("\n");
-            }
-            break;
-        case SAPP_EVENTTYPE_MOUSE_SCROLL:
-            parcc_zoom(app.camera_controller, winx, winy, event->scroll_y);
-            break;
-        case SAPP_EVENTTYPE_MOUSE_MOVE:
-            parcc_grab_update(app.camera_controller, winx, winy);
-            break;
-        case SAPP_EVENTTYPE_MOUSE_ENTER:
-        case SAPP_EVENTTYPE_MOUSE_LEAVE:
-            break;
-        case SAPP_EVENTTYPE_TOUCHES_BEGAN:
-            break;
-        case SAPP_EVENTTYPE_TOUCHES_MOVED:
-            break;
-        case SAPP_EVENTTYPE_TOUCHES_ENDED:
-        case SAPP_EVENTTYPE_TOUCHES_CANCELLED:
-            break;
-        default:
-            break;
+    // A function key, so that typing into the GUI never triggers it.
+    if (event->type == SAPP_EVENTTYPE_KEY_DOWN && event->key_code == SAPP_KEYCODE_F12 &&
+        !event->key_repeat) {
+        trace_dump(trace_file);
+        return;
+    }
+    app_handle_event(&app, event);
+}
+
+static void init() {
+    // Pick rays recorded here are a workload for tune_bvh.
+    if (sargs_exists("record_rays")) {
+        app.ray_log = fopen(sargs_value("record_rays"), "wb");
+    }
+    sg_setup(&(sg_desc){
+        .mtl_device = sapp_metal_get_device(),
+        .mtl_renderpass_descriptor_cb = sapp_metal_get_renderpass_descriptor,
+        .mtl_drawable_cb = sapp_metal_get_drawable,
+    });
+    app.width = sapp_width();
+    app.height = sapp_height();
+    app.threaded_update = sargs_boolean("threaded_update");
+    // The F12 key dumps a trace at any time. With trace=<file>, one is also dumped on exit.
+    if (sargs_exists("trace")) {
+        trace_file = sargs_value("trace");
+    }
+    app_init(&app);
+    // Input recorded here can be replayed by camera_demo_bench.
+    if (sargs_exists("record_input")) {
+        input_log = replay_create(sargs_value("record_input"), app.width, app.height);
+        record_start = stm_now();
     }
 }
 
-static void init() { app_init(&app); }
 static void draw() { app_draw(&app); }
 
+static void cleanup() {
+    app_shutdown(&app);
+    if (app.ray_log) {
+        fclose(app.ray_log);
+    }
+    if (input_log) {
+        fclose(input_log);
+    }
+    if (sargs_exists("trace")) {
+        trace_dump(trace_file);
+    }
+    sargs_shutdown();
+}
+
 sapp_desc sokol_main(int argc, char* argv[]) {
+    sargs_setup(&(sargs_desc){.argc = argc, .argv = argv});
     return (sapp_desc){
         .init_cb = init,
         .frame_cb = draw,
+        .cleanup_cb = cleanup,
         .event_cb = handler,
         .width = 1280,
         .height = 720,
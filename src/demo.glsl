@@ -84,3 +84,34 @@ void main() {
     frag_color = texture(terrain, vuv);
     frag_color.a = 1.0;
 }
+
+-- gui.vs
+
+layout(location=0) in vec2 position;
+layout(location=1) in vec2 texcoord;
+layout(location=2) in vec4 color;
+
+uniform vec2 display_size;
+
+out vec2 vuv;
+out vec4 vcolor;
+
+void main() {
+  vec2 ndc = 2.0 * position / display_size - 1.0;
+  gl_Position = vec4(ndc.x, -ndc.y, 0.0, 1.0);
+  vuv = texcoord;
+  vcolor = color;
+}
+
+-- gui.fs
+
+in vec2 vuv;
+in vec4 vcolor;
+
+uniform sampler2D atlas;
+
+out vec4 frag_color;
+
+void main() {
+    frag_color = vec4(1.0, 1.0, 1.0, texture(atlas, vuv).r) * vcolor;
+}
@@ -1,15 +1,44 @@
-#define SOKOL_GLCORE33
-#define SOKOL_GL_IMPL
-
 #include "gui.h"
 #include "app.h"
+#include "trace.h"
 
 #include <microui/microui.h>
 
 #include <sokol/sokol_gfx.h>
-#include <sokol/util/sokol_gl.h>
+#include <sokol/sokol_time.h>
+
+#include <par/par_shaders.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Quads are drawn as indexed pairs of triangles, so 16-bit indices cover 16384 of them.
+#define kGuiMaxQuads (16384)
+#define kGuiMaxDraws (512)
+
+// The font atlas only covers ASCII, so other bytes draw and measure as its last glyph.
+#define glyph_index(c) ((c) < 127 ? (c) : 127)
+
+typedef struct {
+    float x, y;
+    float u, v;
+    uint32_t color;
+} GuiVertex;
+
+// A run of quads drawn with one scissor rect.
+typedef struct {
+    mu_Rect clip;
+    int base_quad;
+    int num_quads;
+} GuiDraw;
+
+// What the last drawn frame cost the GPU side of the GUI.
+typedef struct {
+    int draw_calls;
+    int vertices;
+    bool rebuilt;
+} GuiStats;
 
 struct GuiImpl {
     mu_Context ctx;
@@ -17,9 +46,23 @@ struct GuiImpl {
     mu_Container panel;
     App* app;
     sg_image atlas_img;
-    sgl_pipeline pip;
+    sg_pipeline pipeline;
+    sg_bindings bindings;
     int sidebar_width;
+    // The sidebar is the only thing that edits these, so it keeps its own copy rather than waiting
+    // for the update thread to apply each edit.
+    CameraOptions options;
     bool open_load_dialog;
+    int perf_expanded;
+
+    // The vertex stream for the last command list that was drawn, and the hash of that command
+    // list. The sidebar rarely changes, so most frames just draw the buffer again.
+    uint64_t command_hash;
+    GuiVertex vertices[4 * kGuiMaxQuads];
+    int num_quads;
+    GuiDraw draws[kGuiMaxDraws];
+    int num_draws;
+    GuiStats stats;
 };
 
 const mu_Color kInfoTextColor = {96, 128, 255, 255};
@@ -30,6 +73,7 @@ const mu_Color kActiveHover = {75, 95, 100, 255};
 const mu_Color kNormalButton = {75, 75, 75, 255};
 const mu_Color kFocusButton = {115, 115, 115, 255};
 const mu_Color kHoverButton = {95, 95, 95, 255};
+const mu_Color kGraphBackground = {30, 30, 30, 255};
 
 static void disable(mu_Context* ctx) {
     ctx->style->colors[MU_COLOR_TEXT] = kDisabledColor;
@@ -71,15 +115,76 @@ static void mux_radio_buttons(const mux_Button* buttons, mu_Context* ctx, int* v
     enable(ctx);
 }
 
+static void define_perf_panel(Gui* gui) {
+    mu_Context* ctx = &gui->ctx;
+    const App* app = gui->app;
+    const PerfHistory* perf = &app->perf;
+    const AppTimings* t = &app->timings;
+    char buf[128];
+
+    mu_layout_row(ctx, 1, (int[]){-1}, 0);
+    if (!mu_header(ctx, &gui->perf_expanded, "Performance")) {
+        return;
+    }
+
+    float total_ms = 0, max_ms = 0;
+    uint32_t max_raycasts = 0;
+    for (int i = 0; i < perf->count; i++) {
+        total_ms += perf->draw_ms[i];
+        max_ms = perf->draw_ms[i] > max_ms ? perf->draw_ms[i] : max_ms;
+        max_raycasts = perf->raycasts[i] > max_raycasts ? perf->raycasts[i] : max_raycasts;
+    }
+
+    // CPU time of app_draw for recent drawn frames, oldest on the left, scaled to the slowest.
+    mu_layout_row(ctx, 1, (int[]){-1}, 48);
+    const mu_Rect graph = mu_layout_next(ctx);
+    mu_draw_rect(ctx, graph, kGraphBackground);
+    const int bar_width = graph.w / kPerfHistorySize > 1 ? graph.w / kPerfHistorySize : 1;
+    const float scale = graph.h / (max_ms > 0.001f ? max_ms : 0.001f);
+    for (int i = 0; i < perf->count; i++) {
+        const int age = perf->count - i;
+        const int index = (perf->head - age + kPerfHistorySize) % kPerfHistorySize;
+        const int height = (int)(perf->draw_ms[index] * scale) + 1;
+        const mu_Rect bar = {graph.x + graph.w - age * bar_width, graph.y + graph.h - height,
+                             bar_width, height};
+        if (bar.x >= graph.x) {
+            mu_draw_rect(ctx, bar, kInfoTextColor);
+        }
+    }
+
+    mu_layout_row(ctx, 1, (int[]){-1}, 0);
+    ctx->style->colors[MU_COLOR_TEXT] = kInfoTextColor;
+    snprintf(buf, 128, "app_draw: %.2f ms (mean %.2f, max %.2f)", stm_ms(t->draw),
+             perf->count ? total_ms / perf->count : 0.0f, max_ms);
+    mu_label(ctx, buf);
+    snprintf(buf, 128, "  define_ui %.2f ms, render_ui %.2f ms", stm_ms(t->define_ui),
+             stm_ms(t->render_ui));
+    mu_label(ctx, buf);
+    snprintf(buf, 128, "  scene %.2f ms, commit %.2f ms", stm_ms(t->scene), stm_ms(t->commit));
+    mu_label(ctx, buf);
+    snprintf(buf, 128, "Raycasts: %u in %.2f ms (max %u per frame)", t->raycasts,
+             stm_ms(t->raycast), max_raycasts);
+    mu_label(ctx, buf);
+    snprintf(buf, 128, "Triangles drawn: %u", t->triangles);
+    mu_label(ctx, buf);
+    snprintf(buf, 128, "GUI: %d draws, %d vertices (%s)", gui->stats.draw_calls,
+             gui->stats.vertices, gui->stats.rebuilt ? "rebuilt" : "cached");
+    mu_label(ctx, buf);
+    ctx->style->colors[MU_COLOR_TEXT] = kActiveColor;
+}
+
+static bool same_options(const CameraOptions* a, const CameraOptions* b) {
+    return a->mode == b->mode && a->fov_orientation == b->fov_orientation &&
+           a->map_constraint == b->map_constraint && a->fov_degrees == b->fov_degrees &&
+           a->raycast_mesh == b->raycast_mesh;
+}
+
+// Reads the camera only through the current snapshot, and changes it only through commands, so
+// it never waits for an update that is still running.
 static void define_ui(Gui* gui) {
     mu_Context* ctx = &gui->ctx;
     App* app = gui->app;
-    parcc_context* camera = app->camera_controller;
-
-    parcc_float eyepos[3];
-    parcc_float target[3];
-    parcc_float upward[3];
-    parcc_get_look_at(camera, eyepos, target, upward);
+    const FrameSnapshot* snapshot = &app->snapshots.slots[app->snapshots.front];
 
     char buf[128];
     mu_begin(ctx);
@@ -90,51 +195,62 @@ static void define_ui(Gui* gui) {
 
     gui->window.rect.x = gui->window.rect.y = 0;
     gui->window.rect.w = gui->sidebar_width;
-    gui->window.rect.h = sapp_height();
+    gui->window.rect.h = app->height;
 
     mu_begin_window_ex(ctx, &gui->window, "", MU_OPT_NOTITLE | MU_OPT_NORESIZE);
 
-    static parcc_properties props;
-    parcc_get_properties(camera, &props);
-    parcc_properties previous = props;
+    CameraOptions* options = &gui->options;
+    const CameraOptions previous = *options;
 
     mu_layout_row(ctx, 2, (int[]){142, -1}, 0);
     mux_radio_buttons((mux_Button[]){{"Orbit mode", PARCC_ORBIT},  //
                                      {"Map mode", PARCC_MAP}},     //
-                      ctx, (int*)&props.mode, 2);
-
-    if (previous.mode != props.mode) {
-        app_goto_frame(app, parcc_get_home_frame(camera));
-        app_clear_frames(app);
-    }
+                      ctx, (int*)&options->mode, 2);
 
     mux_radio_buttons((mux_Button[]){{"Vertical FOV", PARCC_VERTICAL},       //
                                      {"Horizontal FOV", PARCC_HORIZONTAL}},  //
-                      ctx, (int*)&props.fov_orientation, 2);
+                      ctx, (int*)&options->fov_orientation, 2);
 
-    if (props.mode == PARCC_MAP) {
+    if (options->mode == PARCC_MAP) {
         mu_layout_row(ctx, 3, (int[]){93, 93, 93}, 0);
         mux_radio_buttons((mux_Button[]){{"No constraint", PARCC_VERTICAL},
                                          {"Axis constraint", PARCC_CONSTRAIN_AXIS},
                                          {"Full constraint", PARCC_CONSTRAIN_FULL}},
-                          ctx, (int*)&props.map_constraint, 3);
+                          ctx, (int*)&options->map_constraint, 3);
     }
 
     mu_layout_row(ctx, 2, (int[]){85, -1}, 0);
     mu_label(ctx, "FOV Degrees");
-    mu_slider(ctx, &props.fov_degrees, 10, 90);
+    mu_slider(ctx, &options->fov_degrees, 10, 90);
 
     mu_layout_row(ctx, 1, (int[]){-1}, 0);
-    int raycast = props.raycast_function == app_intersects_mesh;
+    int raycast = options->raycast_mesh;
     mu_checkbox(ctx, &raycast, "Raycast with mesh for precise zoom / pan");
-    props.raycast_function = raycast ? app_intersects_mesh : NULL;
+    options->raycast_mesh = raycast;
+
+    if (!same_options(options, &previous)) {
+        app_send_command(app, (CameraCommand){.type = CAMERA_SET_OPTIONS, .options = *options});
+    }
 
     mu_layout_row(ctx, 1, (int[]){-1}, 0);
+    const float* eyepos = snapshot->eye;
     snprintf(buf, 128, "Camera position: %.03g, %.03g, %.03g", eyepos[0], eyepos[1], eyepos[2]);
     ctx->style->colors[MU_COLOR_TEXT] = kInfoTextColor;
     mu_label(ctx, buf);
+
+    const RayCache* cache = &app->ray_cache;
+    const uint32_t hits = atomic_load(&cache->hits);
+    const uint32_t lookups = hits + atomic_load(&cache->misses);
+    snprintf(buf, 128, "Ray cache hits: %u of %u (%.0f%%)", hits, lookups,
+             lookups ? 100.0 * hits / lookups : 0.0);
+    mu_label(ctx, buf);
+
+    snprintf(buf, 128, "Selected triangles: %zu (shift-drag)", snapshot->num_selected);
+    mu_label(ctx, buf);
     ctx->style->colors[MU_COLOR_TEXT] = kActiveColor;
 
+    define_perf_panel(gui);
+
     // blank area
     mu_layout_row(ctx, 1, (int[]){-1}, -82);
     mu_label(ctx, "");
@@ -142,35 +258,33 @@ static void define_ui(Gui* gui) {
     // bottom pane
     mu_layout_row(ctx, 1, (int[]){-1}, 0);
     if (mu_button(ctx, "Go to Home Frame")) {
-        app_goto_frame(app, parcc_get_home_frame(camera));
+        app_send_command(app, (CameraCommand){.type = CAMERA_GO_HOME});
     }
 
     mu_layout_row(ctx, 2, (int[]){142, -1}, 0);
     if (mu_button(ctx, "Save Frame A")) {
-        app_save_frame(app, 0);
+        app_send_command(app, (CameraCommand){.type = CAMERA_SAVE_FRAME, .frame_index = 0});
     }
-    if (!app->has_frame[0]) {
+    if (!snapshot->has_frame[0]) {
         disable(ctx);
     }
-    if (mu_button(ctx, "Go to Frame A") && app->has_frame[0]) {
-        app_goto_frame(app, app->saved_frame[0]);
+    if (mu_button(ctx, "Go to Frame A") && snapshot->has_frame[0]) {
+        app_send_command(app, (CameraCommand){.type = CAMERA_GOTO_FRAME, .frame_index = 0});
     }
     enable(ctx);
 
     if (mu_button(ctx, "Save Frame B")) {
-        app_save_frame(app, 1);
+        app_send_command(app, (CameraCommand){.type = CAMERA_SAVE_FRAME, .frame_index = 1});
     }
-    if (!app->has_frame[1]) {
+    if (!snapshot->has_frame[1]) {
         disable(ctx);
     }
-    if (mu_button(ctx, "Go to Frame B") && app->has_frame[1]) {
-        app_goto_frame(app, app->saved_frame[1]);
+    if (mu_button(ctx, "Go to Frame B") && snapshot->has_frame[1]) {
+        app_send_command(app, (CameraCommand){.type = CAMERA_GOTO_FRAME, .frame_index = 1});
     }
     enable(ctx);
 
     mu_end_window(ctx);
-
-    parcc_set_properties(camera, &props);
     mu_end(ctx);
 }
 
@@ -178,16 +292,9 @@ static int text_width_cb(mu_Font font, const char* text, int len);
 static int text_height_cb(mu_Font font);
 
 static void r_init(Gui* gui);
-static void r_begin(Gui* gui, int disp_width, int disp_height);
-static void r_end(void);
-static void r_draw(void);
-static void r_push_quad(mu_Rect dst, mu_Rect src, mu_Color color);
-static void r_draw_rect(mu_Rect rect, mu_Color color);
-static void r_draw_text(const char* text, mu_Vec2 pos, mu_Color color);
-static void r_draw_icon(int id, mu_Rect rect, mu_Color color);
+static void r_build(Gui* gui);
 static int r_get_text_width(const char* text, int len);
 static int r_get_text_height(void);
-static void r_set_clip_rect(mu_Rect rect);
 
 static void define_ui(Gui* gui);
 static void render_ui(Gui* gui);
@@ -197,7 +304,17 @@ Gui* gui_create(App* app, int sidebar_width) {
     memset(retval, 0, sizeof(struct GuiImpl));
     retval->app = app;
     retval->sidebar_width = sidebar_width;
-    sgl_setup(&(sgl_desc_t){0});
+
+    // The update thread has not started yet, so the camera can be read directly.
+    parcc_properties props;
+    parcc_get_properties(app->camera_controller, &props);
+    retval->options = (CameraOptions){
+        .mode = props.mode,
+        .fov_orientation = props.fov_orientation,
+        .map_constraint = props.map_constraint,
+        .fov_degrees = props.fov_degrees,
+        .raycast_mesh = props.raycast_function == app_intersects_mesh,
+    };
     r_init(retval);
     mu_init(&retval->ctx);
     retval->ctx.text_width = text_width_cb;
@@ -206,7 +323,9 @@ Gui* gui_create(App* app, int sidebar_width) {
 }
 
 void gui_destroy(Gui* gui) {
-    sgl_shutdown();
+    sg_destroy_buffer(gui->bindings.vertex_buffers[0]);
+    sg_destroy_pipeline(gui->pipeline);
+    sg_destroy_image(gui->atlas_img);
     free(gui);
 }
 
@@ -237,13 +356,6 @@ bool gui_handle(Gui* gui, const sapp_event* ev) {
         case SAPP_EVENTTYPE_KEY_UP:
             mu_input_keyup(ctx, key_map[ev->key_code & 511]);
             break;
-        case SAPP_EVENTTYPE_CHAR: {
-            char key = ev->char_code & 255;
-            if (key == 27) {
-                sapp_request_quit();
-            }
-            break;
-        }
         default:
             break;
     }
@@ -260,92 +372,187 @@ bool gui_handle(Gui* gui, const sapp_event* ev) {
 }
 
 void gui_draw(Gui* gui) {
+    AppTimings* timings = &gui->app->timings;
+    uint64_t start = stm_now();
+    trace_begin("gui_draw");
+    trace_begin("render_ui");
     render_ui(gui);
+    trace_end();
+    timings->render_ui = stm_laptime(&start);
+    trace_begin("define_ui");
     define_ui(gui);
+    trace_end();
+    timings->define_ui = stm_laptime(&start);
+    trace_end();
 }
 
-static void render_ui(Gui* gui) {
-    r_begin(gui, sapp_width(), sapp_height());
-    mu_Command* cmd = 0;
-    while (mu_next_command(&gui->ctx, &cmd)) {
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const unsigned char* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Hashes only the fields that reach the vertex stream, in drawing order. The raw command bytes
+// would also take in struct padding and jump targets, which can differ between identical frames.
+static uint64_t hash_commands(mu_Context* ctx) {
+    uint64_t hash = 14695981039346656037ull;
+    mu_Command* cmd = NULL;
+    while (mu_next_command(ctx, &cmd)) {
+        hash = hash_bytes(hash, &cmd->type, sizeof(cmd->type));
         switch (cmd->type) {
             case MU_COMMAND_TEXT:
-                r_draw_text(cmd->text.str, cmd->text.pos, cmd->text.color);
+                hash = hash_bytes(hash, &cmd->text.pos, sizeof(cmd->text.pos));
+                hash = hash_bytes(hash, &cmd->text.color, sizeof(cmd->text.color));
+                hash = hash_bytes(hash, cmd->text.str, strlen(cmd->text.str));
                 break;
             case MU_COMMAND_RECT:
-                r_draw_rect(cmd->rect.rect, cmd->rect.color);
+                hash = hash_bytes(hash, &cmd->rect.rect, sizeof(cmd->rect.rect));
+                hash = hash_bytes(hash, &cmd->rect.color, sizeof(cmd->rect.color));
                 break;
             case MU_COMMAND_ICON:
-                r_draw_icon(cmd->icon.id, cmd->icon.rect, cmd->icon.color);
+                hash = hash_bytes(hash, &cmd->icon.id, sizeof(cmd->icon.id));
+                hash = hash_bytes(hash, &cmd->icon.rect, sizeof(cmd->icon.rect));
+                hash = hash_bytes(hash, &cmd->icon.color, sizeof(cmd->icon.color));
                 break;
             case MU_COMMAND_CLIP:
-                r_set_clip_rect(cmd->clip.rect);
+                hash = hash_bytes(hash, &cmd->clip.rect, sizeof(cmd->clip.rect));
                 break;
         }
     }
-    r_end();
-    r_draw();
+    return hash;
 }
 
-static int text_width_cb(mu_Font font, const char* text, int len) {
-    if (len == -1) {
-        len = (int)strlen(text);
+static void render_ui(Gui* gui) {
+    // The vertices depend only on the command list, so only rebuild them when it changes. The
+    // buffer is then updated at most once per frame, in a single upload.
+    const uint64_t hash = hash_commands(&gui->ctx);
+    gui->stats.rebuilt = hash != gui->command_hash;
+    if (gui->stats.rebuilt) {
+        gui->command_hash = hash;
+        r_build(gui);
+        if (gui->num_quads > 0) {
+            sg_update_buffer(gui->bindings.vertex_buffers[0], gui->vertices,
+                             4 * gui->num_quads * sizeof(GuiVertex));
+        }
+    }
+    gui->stats.draw_calls = gui->num_draws;
+    gui->stats.vertices = 4 * gui->num_quads;
+    if (gui->num_quads == 0) {
+        return;
     }
+    const float display_size[2] = {gui->app->width, gui->app->height};
+    sg_apply_pipeline(gui->pipeline);
+    sg_apply_bindings(&gui->bindings);
+    sg_apply_uniforms(SG_SHADERSTAGE_VS, 0, display_size, sizeof(display_size));
+    for (int i = 0; i < gui->num_draws; i++) {
+        const GuiDraw* draw = &gui->draws[i];
+        sg_apply_scissor_rect(draw->clip.x, draw->clip.y, draw->clip.w, draw->clip.h, true);
+        sg_draw(6 * draw->base_quad, 6 * draw->num_quads, 1);
+    }
+    sg_apply_scissor_rect(0, 0, gui->app->width, gui->app->height, true);
+}
+
+static int text_width_cb(mu_Font font, const char* text, int len) {
+    (void)font;
     return r_get_text_width(text, len);
 }
 
-static int text_height_cb(mu_Font font) { return r_get_text_height(); }
+static int text_height_cb(mu_Font font) {
+    (void)font;
+    return r_get_text_height();
+}
 
 static void r_init(Gui* gui) {
-    /* atlas image data is in atlas.inl file, this only contains alpha
-       values, need to expand this to RGBA8
-    */
-    uint32_t rgba8_size = ATLAS_WIDTH * ATLAS_HEIGHT * 4;
-    uint32_t* rgba8_pixels = (uint32_t*)malloc(rgba8_size);
-    for (int y = 0; y < ATLAS_HEIGHT; y++) {
-        for (int x = 0; x < ATLAS_WIDTH; x++) {
-            uint32_t index = y * ATLAS_WIDTH + x;
-            rgba8_pixels[index] = 0x00FFFFFF | ((uint32_t)atlas_texture[index] << 24);
-        }
+    // The atlas only holds alpha values. It is uploaded as-is to a single-channel image, and the
+    // fragment shader turns the red channel into white with that alpha.
+    gui->atlas_img = sg_make_image(&(sg_image_desc){
+        .width = ATLAS_WIDTH,
+        .height = ATLAS_HEIGHT,
+        .pixel_format = SG_PIXELFORMAT_R8,
+        /* LINEAR would be better for text quality in HighDPI, but the
+           atlas texture is "leaking" from neighbouring pixels unfortunately
+        */
+        .min_filter = SG_FILTER_NEAREST,
+        .mag_filter = SG_FILTER_NEAREST,
+        .content = {.subimage[0][0] = {.ptr = atlas_texture, .size = sizeof(atlas_texture)}}});
+
+    parsh_context* shaders = parsh_create_context_from_file("src/demo.glsl");
+    parsh_add_block(shaders, "prefix", "#version 330\n");
+
+    sg_shader program = sg_make_shader(&(sg_shader_desc){
+        .vs.uniform_blocks[0].size = 2 * sizeof(float),
+        .vs.uniform_blocks[0].uniforms[0].name = "display_size",
+        .vs.uniform_blocks[0].uniforms[0].type = SG_UNIFORMTYPE_FLOAT2,
+        .fs.images[0].name = "atlas",
+        .fs.images[0].type = SG_IMAGETYPE_2D,
+        .vs.source = parsh_get_blocks(shaders, "prefix gui.vs"),
+        .fs.source = parsh_get_blocks(shaders, "prefix gui.fs"),
+    });
+
+    gui->pipeline = sg_make_pipeline(&(sg_pipeline_desc){
+        .shader = program,
+        .index_type = SG_INDEXTYPE_UINT16,
+        .blend.enabled = true,
+        .blend.src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
+        .blend.dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA,
+        .rasterizer.cull_mode = SG_CULLMODE_NONE,
+        .layout.attrs[0].format = SG_VERTEXFORMAT_FLOAT2,
+        .layout.attrs[1].format = SG_VERTEXFORMAT_FLOAT2,
+        .layout.attrs[2].format = SG_VERTEXFORMAT_UBYTE4N,
+    });
+
+    // Every quad uses the same two triangles, so the index buffer never changes.
+    uint16_t* indices = malloc(6 * kGuiMaxQuads * sizeof(uint16_t));
+    for (int quad = 0; quad < kGuiMaxQuads; quad++) {
+        const uint16_t base = 4 * quad;
+        uint16_t* index = &indices[6 * quad];
+        index[0] = base + 0, index[1] = base + 1, index[2] = base + 2;
+        index[3] = base + 0, index[4] = base + 2, index[5] = base + 3;
     }
-    gui->atlas_img = sg_make_image(
-        &(sg_image_desc){.width = ATLAS_WIDTH,
-                         .height = ATLAS_HEIGHT,
-                         /* LINEAR would be better for text quality in HighDPI, but the
-                            atlas texture is "leaking" from neighbouring pixels unfortunately
-                         */
-                         .min_filter = SG_FILTER_NEAREST,
-                         .mag_filter = SG_FILTER_NEAREST,
-                         .content = {.subimage[0][0] = {.ptr = rgba8_pixels, .size = rgba8_size}}});
-    gui->pip = sgl_make_pipeline(
-        &(sg_pipeline_desc){.blend = {.enabled = true,
-                                      .src_factor_rgb = SG_BLENDFACTOR_SRC_ALPHA,
-                                      .dst_factor_rgb = SG_BLENDFACTOR_ONE_MINUS_SRC_ALPHA}});
-
-    free(rgba8_pixels);
+    gui->bindings = (sg_bindings){
+        .vertex_buffers[0] = sg_make_buffer(&(sg_buffer_desc){
+            .size = sizeof(gui->vertices),
+            .usage = SG_USAGE_DYNAMIC,
+        }),
+        .index_buffer = sg_make_buffer(&(sg_buffer_desc){
+            .type = SG_BUFFERTYPE_INDEXBUFFER,
+            .size = 6 * kGuiMaxQuads * sizeof(uint16_t),
+            .content = indices,
+        }),
+        .fs_images[0] = gui->atlas_img,
+    };
+    free(indices);
 }
 
-static void r_begin(Gui* gui, int disp_width, int disp_height) {
-    sgl_defaults();
-    sgl_push_pipeline();
-    sgl_load_pipeline(gui->pip);
-    sgl_enable_texture();
-    sgl_texture(gui->atlas_img);
-    sgl_matrix_mode_projection();
-    sgl_push_matrix();
-    sgl_ortho(0.0f, (float)disp_width, (float)disp_height, 0.0f, -1.0f, +1.0f);
-    sgl_begin_quads();
+// Starts a new batch only if the scissor rect actually changes. A batch that is still empty is
+// reused, so runs of clip commands with nothing drawn in between cost nothing.
+static void r_set_clip_rect(Gui* gui, mu_Rect rect) {
+    GuiDraw* draw = gui->num_draws > 0 ? &gui->draws[gui->num_draws - 1] : NULL;
+    if (draw && !memcmp(&draw->clip, &rect, sizeof(rect))) {
+        return;
+    }
+    if (!draw || draw->num_quads > 0) {
+        if (gui->num_draws == kGuiMaxDraws) {
+            return;
+        }
+        draw = &gui->draws[gui->num_draws++];
+    }
+    draw->clip = rect;
+    draw->base_quad = gui->num_quads;
+    draw->num_quads = 0;
 }
 
-static void r_end(void) {
-    sgl_end();
-    sgl_pop_matrix();
-    sgl_pop_pipeline();
+static uint32_t pack_color(mu_Color color) {
+    return (uint32_t)color.r | ((uint32_t)color.g << 8) | ((uint32_t)color.b << 16) |
+           ((uint32_t)color.a << 24);
 }
 
-static void r_draw(void) { sgl_draw(); }
-
-static void r_push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
+static void r_push_quad(Gui* gui, mu_Rect dst, mu_Rect src, uint32_t rgba) {
+    if (gui->num_quads == kGuiMaxQuads) {
+        return;
+    }
     float u0 = (float)src.x / (float)ATLAS_WIDTH;
     float v0 = (float)src.y / (float)ATLAS_HEIGHT;
     float u1 = (float)(src.x + src.w) / (float)ATLAS_WIDTH;
@@ -356,47 +563,72 @@ static void r_push_quad(mu_Rect dst, mu_Rect src, mu_Color color) {
     float x1 = (float)(dst.x + dst.w);
     float y1 = (float)(dst.y + dst.h);
 
-    sgl_c4b(color.r, color.g, color.b, color.a);
-    sgl_v2f_t2f(x0, y0, u0, v0);
-    sgl_v2f_t2f(x1, y0, u1, v0);
-    sgl_v2f_t2f(x1, y1, u1, v1);
-    sgl_v2f_t2f(x0, y1, u0, v1);
+    GuiVertex* v = &gui->vertices[4 * gui->num_quads];
+    v[0] = (GuiVertex){x0, y0, u0, v0, rgba};
+    v[1] = (GuiVertex){x1, y0, u1, v0, rgba};
+    v[2] = (GuiVertex){x1, y1, u1, v1, rgba};
+    v[3] = (GuiVertex){x0, y1, u0, v1, rgba};
+    gui->num_quads++;
+    gui->draws[gui->num_draws - 1].num_quads++;
 }
 
-static void r_draw_rect(mu_Rect rect, mu_Color color) {
-    r_push_quad(rect, atlas[ATLAS_WHITE], color);
+static void r_draw_rect(Gui* gui, mu_Rect rect, mu_Color color) {
+    r_push_quad(gui, rect, atlas[ATLAS_WHITE], pack_color(color));
 }
 
-static void r_draw_text(const char* text, mu_Vec2 pos, mu_Color color) {
+static void r_draw_text(Gui* gui, const char* text, mu_Vec2 pos, mu_Color color) {
+    const uint32_t rgba = pack_color(color);
     mu_Rect dst = {pos.x, pos.y, 0, 0};
     for (const char* p = text; *p; p++) {
-        mu_Rect src = atlas[ATLAS_FONT + (unsigned char)*p];
+        mu_Rect src = atlas[ATLAS_FONT + glyph_index((unsigned char)*p)];
         dst.w = src.w;
         dst.h = src.h;
-        r_push_quad(dst, src, color);
+        r_push_quad(gui, dst, src, rgba);
         dst.x += dst.w;
     }
 }
 
-static void r_draw_icon(int id, mu_Rect rect, mu_Color color) {
+static void r_draw_icon(Gui* gui, int id, mu_Rect rect, mu_Color color) {
     mu_Rect src = atlas[id];
     int x = rect.x + (rect.w - src.w) / 2;
     int y = rect.y + (rect.h - src.h) / 2;
-    r_push_quad(mu_rect(x, y, src.w, src.h), src, color);
+    r_push_quad(gui, mu_rect(x, y, src.w, src.h), src, pack_color(color));
+}
+
+// Converts the microui command list into quads, batched by scissor rect.
+static void r_build(Gui* gui) {
+    gui->num_quads = 0;
+    gui->num_draws = 0;
+    r_set_clip_rect(gui, mu_rect(0, 0, gui->app->width, gui->app->height));
+    mu_Command* cmd = 0;
+    while (mu_next_command(&gui->ctx, &cmd)) {
+        switch (cmd->type) {
+            case MU_COMMAND_TEXT:
+                r_draw_text(gui, cmd->text.str, cmd->text.pos, cmd->text.color);
+                break;
+            case MU_COMMAND_RECT:
+                r_draw_rect(gui, cmd->rect.rect, cmd->rect.color);
+                break;
+            case MU_COMMAND_ICON:
+                r_draw_icon(gui, cmd->icon.id, cmd->icon.rect, cmd->icon.color);
+                break;
+            case MU_COMMAND_CLIP:
+                r_set_clip_rect(gui, cmd->clip.rect);
+                break;
+        }
+    }
+    if (gui->num_draws > 0 && gui->draws[gui->num_draws - 1].num_quads == 0) {
+        gui->num_draws--;
+    }
 }
 
+// A length of -1 measures up to the terminator, so microui's calls need no strlen first.
 static int r_get_text_width(const char* text, int len) {
     int res = 0;
-    for (const char* p = text; *p && len--; p++) {
-        res += atlas[ATLAS_FONT + (unsigned char)*p].w;
+    for (const unsigned char* p = (const unsigned char*)text; *p && len != 0; p++, len--) {
+        res += atlas[ATLAS_FONT + glyph_index(*p)].w;
     }
     return res;
 }
 
 static int r_get_text_height(void) { return 18; }
-
-static void r_set_clip_rect(mu_Rect rect) {
-    sgl_end();
-    sgl_scissor_rect(rect.x, rect.y, rect.w, rect.h, true);
-    sgl_begin_quads();
-}
@@ -0,0 +1,22 @@
+// Single-header implementations for camera_demo_bench. Mirrors platform.mm, but there is no
+// window, so sokol_app is left out and sokol_gfx uses SOKOL_DUMMY_BACKEND from the build.
+
+#define SOKOL_IMPL
+#define PARSH_ENABLE_STDIO
+#define PAR_SHADERS_IMPLEMENTATION
+#define PAR_MSQUARES_IMPLEMENTATION
+#define STB_IMAGE_RESIZE_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define NANO_RT_C_IMPLEMENTATION 1
+
+#include <par/par_shaders.h>
+#include <par/par_msquares.h>
+
+#include <sokol/sokol_gfx.h>
+#include <sokol/sokol_time.h>
+
+#include <stb/stb_image.h>
+#include <stb/stb_image_resize.h>
+
+#include <nanort/nanort_c.h>
@@ -0,0 +1,133 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include <sokol/sokol_time.h>
+
+#include "pick.h"
+#include "trace.h"
+
+typedef struct {
+    part_ray ray;
+    int winx;
+    int winy;
+    uint64_t submit_time;
+} PickRequest;
+
+struct PickServiceImpl {
+    PickTraceFunction trace;
+    void* userdata;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool quit;
+    PickRequest requests[kPickQueueSize];
+    int request_head;
+    int request_count;
+    PickResult results[kPickQueueSize];
+    int result_head;
+    int result_count;
+};
+
+static PickResult trace(PickService* service, PickRequest request) {
+    PickResult result = {
+        .winx = request.winx,
+        .winy = request.winy,
+        .submit_time = request.submit_time,
+    };
+    const uint64_t start = stm_now();
+    trace_begin("pick");
+    float t;
+    result.hit = service->trace(request.ray, &t, &result.stats, service->userdata);
+    if (result.hit) {
+        for (int i = 0; i < 3; i++) {
+            result.position[i] = request.ray.org[i] + t * request.ray.dir[i];
+        }
+    }
+    result.trace_ms = stm_ms(stm_diff(stm_now(), start));
+    trace_end();
+    return result;
+}
+
+static void* worker(void* arg) {
+    PickService* service = arg;
+    trace_set_thread_name("pick");
+    pthread_mutex_lock(&service->mutex);
+    while (true) {
+        while (service->request_count == 0 && !service->quit) {
+            pthread_cond_wait(&service->wake, &service->mutex);
+        }
+        if (service->quit) {
+            break;
+        }
+        const PickRequest request = service->requests[service->request_head];
+        service->request_head = (service->request_head + 1) % kPickQueueSize;
+        service->request_count--;
+
+        pthread_mutex_unlock(&service->mutex);
+        const PickResult result = trace(service, request);
+        pthread_mutex_lock(&service->mutex);
+
+        // If the main loop has stopped draining, drop the oldest result.
+        if (service->result_count == kPickQueueSize) {
+            service->result_head = (service->result_head + 1) % kPickQueueSize;
+            service->result_count--;
+        }
+        const int tail = (service->result_head + service->result_count) % kPickQueueSize;
+        service->results[tail] = result;
+        service->result_count++;
+    }
+    pthread_mutex_unlock(&service->mutex);
+    return NULL;
+}
+
+PickService* pick_create(PickTraceFunction trace, void* userdata) {
+    PickService* service = calloc(1, sizeof(PickService));
+    service->trace = trace;
+    service->userdata = userdata;
+    pthread_mutex_init(&service->mutex, NULL);
+    pthread_cond_init(&service->wake, NULL);
+    pthread_create(&service->thread, NULL, worker, service);
+    return service;
+}
+
+void pick_destroy(PickService* service) {
+    pthread_mutex_lock(&service->mutex);
+    service->quit = true;
+    pthread_cond_signal(&service->wake);
+    pthread_mutex_unlock(&service->mutex);
+    pthread_join(service->thread, NULL);
+    pthread_cond_destroy(&service->wake);
+    pthread_mutex_destroy(&service->mutex);
+    free(service);
+}
+
+bool pick_submit(PickService* service, part_ray ray, int winx, int winy) {
+    const PickRequest request = {
+        .ray = ray,
+        .winx = winx,
+        .winy = winy,
+        .submit_time = stm_now(),
+    };
+    pthread_mutex_lock(&service->mutex);
+    const bool accepted = service->request_count < kPickQueueSize;
+    if (accepted) {
+        const int tail = (service->request_head + service->request_count) % kPickQueueSize;
+        service->requests[tail] = request;
+        service->request_count++;
+        pthread_cond_signal(&service->wake);
+    }
+    pthread_mutex_unlock(&service->mutex);
+    return accepted;
+}
+
+int pick_drain(PickService* service, PickResult* results, int capacity) {
+    pthread_mutex_lock(&service->mutex);
+    int count = 0;
+    while (count < capacity && service->result_count > 0) {
+        results[count++] = service->results[service->result_head];
+        service->result_head = (service->result_head + 1) % kPickQueueSize;
+        service->result_count--;
+    }
+    pthread_mutex_unlock(&service->mutex);
+    return count;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <nanort/nanort_c.h>
+
+#define kPickQueueSize (16)
+
+typedef struct PickServiceImpl PickService;
+
+typedef struct {
+    int winx;
+    int winy;
+    bool hit;
+    float position[3];
+    uint64_t submit_time;
+    double trace_ms;
+    part_trace_stats stats;
+} PickResult;
+
+// Finds the nearest hit along the ray and fills in the traversal counters of this one trace.
+typedef bool (*PickTraceFunction)(part_ray ray, float* t, part_trace_stats* stats, void* userdata);
+
+// Traces pick rays on a worker thread so that slow traces do not stall the event handler. The
+// trace function runs on the worker without a lock, so it must only read data that stays fixed
+// while the service is alive.
+PickService* pick_create(PickTraceFunction trace, void* userdata);
+void pick_destroy(PickService* service);
+
+// Returns false if the queue is full, in which case the pick is dropped.
+bool pick_submit(PickService* service, part_ray ray, int winx, int winy);
+
+// Copies out the results that have completed since the last call, oldest first.
+int pick_drain(PickService* service, PickResult* results, int capacity);
@@ -12,6 +12,7 @@
 #include <par/par_msquares.h>
 
 #include <sokol/sokol_app.h>
+#include <sokol/sokol_args.h>
 #include <sokol/sokol_gfx.h>
 #include <sokol/sokol_time.h>
 
@@ -0,0 +1,337 @@
+// Microbenchmark for the batched ray/triangle kernels in ray_float.c.
+//
+// Tests a set of rays against a soup of random triangles using the scalar kernel, the one-ray /
+// many-triangle kernels and the many-ray / one-triangle kernels. Verifies that every batched
+// result matches the scalar one, then prints the throughput of each.
+//
+// Also compares intersect_quad against the two-triangle method that it replaced, and times the
+// slab tests for boxes.
+
+#define _POSIX_C_SOURCE 199309L
+#define SOKOL_IMPL
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sokol/sokol_time.h>
+
+#include "ray_float.h"
+
+#define kNumTriangles (4096)
+#define kNumRays (1024)
+#define kNumQuads (4096)
+#define kNumBoxes (4096)
+
+typedef struct {
+    float vert[3][3];
+} Triangle;
+
+static float random_float(float lo, float hi) { return lo + (hi - lo) * rand() / (float)RAND_MAX; }
+
+// Counts the hits in the scalar result and checks a batched result against it.
+static int check(const bool* hits, const float* ts, int ray, int tri, int mask, int lane,
+                 const float* t) {
+    const int index = ray * kNumTriangles + tri;
+    const bool hit = (mask >> lane) & 1;
+    if (hit != hits[index] || (hit && t[lane] != ts[index])) {
+        printf("Mismatch at ray %d, triangle %d\n", ray, tri);
+        return 1;
+    }
+    return 0;
+}
+
+// The previous intersect_quad: two triangle tests, then a projection onto the quad's edges.
+static bool intersect_quad_triangles(const float orig[3], const float dir[3], const float sw[3],
+                                     const float se[3], const float ne[3], const float nw[3],
+                                     float* t, float* u, float* v) {
+    if (!intersect_triangle(orig, dir, sw, se, ne, t, u, v) &&
+        !intersect_triangle(orig, dir, ne, nw, sw, t, u, v)) {
+        return false;
+    }
+    float p[3], udir[3], vdir[3];
+    for (int i = 0; i < 3; i++) {
+        p[i] = orig[i] + *t * dir[i] - sw[i];
+        udir[i] = se[i] - sw[i];
+        vdir[i] = nw[i] - sw[i];
+    }
+    const float ulen2 = udir[0] * udir[0] + udir[1] * udir[1] + udir[2] * udir[2];
+    const float vlen2 = vdir[0] * vdir[0] + vdir[1] * vdir[1] + vdir[2] * vdir[2];
+    *u = (p[0] * udir[0] + p[1] * udir[1] + p[2] * udir[2]) / ulen2;
+    *v = (p[0] * vdir[0] + p[1] * vdir[1] + p[2] * vdir[2]) / vlen2;
+    return true;
+}
+
+static void bench_quads(float (*origins)[3], float (*directions)[3]) {
+    // Planar convex quads: parallelograms in a tilted plane with a perturbed far corner.
+    float(*quads)[4][3] = malloc(sizeof(float) * 12 * kNumQuads);
+    for (int i = 0; i < kNumQuads; i++) {
+        const float center[3] = {random_float(0, 1), random_float(0, 1), random_float(0, 0.1f)};
+        const float slope[2] = {random_float(-0.5f, 0.5f), random_float(-0.5f, 0.5f)};
+        const float size[2] = {random_float(0.02f, 0.1f), random_float(0.02f, 0.1f)};
+        const float corners[4][2] = {
+            {0, 0},
+            {size[0], 0},
+            {size[0] * random_float(0.8f, 1.2f), size[1] * random_float(0.8f, 1.2f)},
+            {0, size[1]},
+        };
+        for (int k = 0; k < 4; k++) {
+            quads[i][k][0] = center[0] + corners[k][0];
+            quads[i][k][1] = center[1] + corners[k][1];
+            quads[i][k][2] = center[2] + slope[0] * corners[k][0] + slope[1] * corners[k][1];
+        }
+    }
+
+    int hits[2] = {0, 0};
+    double ms[2];
+    for (int method = 0; method < 2; method++) {
+        const uint64_t start = stm_now();
+        for (int ray = 0; ray < kNumRays; ray++) {
+            for (int i = 0; i < kNumQuads; i++) {
+                float t, u, v;
+                float(*q)[3] = quads[i];
+                hits[method] += method == 0 ? intersect_quad_triangles(origins[ray],
+                                                                       directions[ray], q[0], q[1],
+                                                                       q[2], q[3], &t, &u, &v)
+                                            : intersect_quad(origins[ray], directions[ray], q[0],
+                                                             q[1], q[2], q[3], &t, &u, &v);
+            }
+        }
+        ms[method] = stm_ms(stm_diff(stm_now(), start));
+    }
+
+    // The methods may disagree on hits that graze an edge, so only report the difference.
+    const size_t num_tests = (size_t)kNumRays * kNumQuads;
+    printf("%d rays x %d quads, %d hits with triangles, %d with intersect_quad\n", kNumRays,
+           kNumQuads, hits[0], hits[1]);
+    printf("two triangles        %7.1f ms  %6.1f Mtests/s\n", ms[0], num_tests / ms[0] / 1e3);
+    printf("intersect_quad       %7.1f ms  %6.1f Mtests/s\n", ms[1], num_tests / ms[1] / 1e3);
+    free(quads);
+}
+
+// Rays parallel to a slab with the origin exactly on one of its planes, where a naive slab test
+// computes 0 * inf = NaN. Returns the number of wrong results from either box test.
+static int check_parallel_boxes(void) {
+    const float min_corner[3] = {0, 0, 0};
+    const float max_corner[3] = {1, 1, 1};
+    Float3x4 min4, max4;
+    for (int axis = 0; axis < 3; axis++) {
+        for (int lane = 0; lane < 4; lane++) {
+            min4.v[axis][lane] = min_corner[axis];
+            max4.v[axis][lane] = max_corner[axis];
+        }
+    }
+    const struct {
+        float orig[3];
+        float dir[3];
+        bool hit;
+    } cases[] = {
+        {{0, 0.5f, -1}, {0, 0, 1}, true},    // on the min plane of x
+        {{1, 0.5f, -1}, {0, 0, 1}, true},    // on the max plane of x
+        {{0, 0, -1}, {0, 0, 1}, true},       // along an edge
+        {{1.5f, 0.5f, -1}, {0, 0, 1}, false},
+        {{0.5f, 1, 2}, {0.2f, 0, -1}, true}, // on the max plane of y, diagonal in xz
+        {{-0.5f, 0, 0.5f}, {1, 0, 0}, true},
+    };
+    const int num_cases = sizeof(cases) / sizeof(cases[0]);
+    int mismatches = 0;
+    for (int i = 0; i < num_cases; i++) {
+        float t, t4[4];
+        const bool hit = intersect_aabb(cases[i].orig, cases[i].dir, min_corner, max_corner, &t);
+        const int mask = intersect_aabb4(cases[i].orig, cases[i].dir, &min4, &max4, t4);
+        if (hit != cases[i].hit || mask != (hit ? 0xf : 0) || (hit && t4[0] != t)) {
+            printf("Mismatch for parallel ray %d\n", i);
+            mismatches++;
+        }
+    }
+    return mismatches;
+}
+
+static void bench_boxes(float (*origins)[3], float (*directions)[3]) {
+    Float3x4* min_corners = malloc(sizeof(Float3x4) * kNumBoxes / 4);
+    Float3x4* max_corners = malloc(sizeof(Float3x4) * kNumBoxes / 4);
+    for (int i = 0; i < kNumBoxes; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            const float lo = random_float(0, axis == 2 ? 0.1f : 1.0f);
+            min_corners[i / 4].v[axis][i % 4] = lo;
+            max_corners[i / 4].v[axis][i % 4] = lo + random_float(0.01f, 0.05f);
+        }
+    }
+
+    int hits = 0;
+    uint64_t start = stm_now();
+    for (int ray = 0; ray < kNumRays; ray++) {
+        for (int i = 0; i < kNumBoxes; i++) {
+            const float minc[3] = {min_corners[i / 4].v[0][i % 4], min_corners[i / 4].v[1][i % 4],
+                                   min_corners[i / 4].v[2][i % 4]};
+            const float maxc[3] = {max_corners[i / 4].v[0][i % 4], max_corners[i / 4].v[1][i % 4],
+                                   max_corners[i / 4].v[2][i % 4]};
+            float t;
+            hits += intersect_aabb(origins[ray], directions[ray], minc, maxc, &t);
+        }
+    }
+    const double scalar_ms = stm_ms(stm_diff(stm_now(), start));
+
+    int hits4 = 0;
+    start = stm_now();
+    for (int ray = 0; ray < kNumRays; ray++) {
+        for (int i = 0; i < kNumBoxes / 4; i++) {
+            float t[4];
+            const int mask = intersect_aabb4(origins[ray], directions[ray], &min_corners[i],
+                                             &max_corners[i], t);
+            hits4 += (mask & 1) + ((mask >> 1) & 1) + ((mask >> 2) & 1) + ((mask >> 3) & 1);
+        }
+    }
+    const double simd_ms = stm_ms(stm_diff(stm_now(), start));
+
+    const size_t num_tests = (size_t)kNumRays * kNumBoxes;
+    printf("%d rays x %d boxes, %d hits with intersect_aabb, %d with intersect_aabb4\n", kNumRays,
+           kNumBoxes, hits, hits4);
+    printf("intersect_aabb       %7.1f ms  %6.2f ns/test\n", scalar_ms,
+           scalar_ms * 1e6 / num_tests);
+    printf("intersect_aabb4      %7.1f ms  %6.2f ns/test\n", simd_ms, simd_ms * 1e6 / num_tests);
+    free(min_corners);
+    free(max_corners);
+}
+
+int main(int argc, char* argv[]) {
+    stm_setup();
+    srand(1);
+
+    // Small triangles over the unit square, with rays that point roughly downward.
+    Triangle* triangles = malloc(sizeof(Triangle) * kNumTriangles);
+    for (int i = 0; i < kNumTriangles; i++) {
+        const float center[3] = {random_float(0, 1), random_float(0, 1), random_float(0, 0.1f)};
+        for (int k = 0; k < 3; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+                triangles[i].vert[k][axis] = center[axis] + random_float(-0.05f, 0.05f);
+            }
+        }
+    }
+    float(*origins)[3] = malloc(sizeof(float) * 3 * kNumRays);
+    float(*directions)[3] = malloc(sizeof(float) * 3 * kNumRays);
+    for (int i = 0; i < kNumRays; i++) {
+        origins[i][0] = random_float(0, 1);
+        origins[i][1] = random_float(0, 1);
+        origins[i][2] = 1.0f;
+        directions[i][0] = random_float(-0.1f, 0.1f);
+        directions[i][1] = random_float(-0.1f, 0.1f);
+        directions[i][2] = -1.0f;
+    }
+
+    Float3x8* packets[3];
+    for (int k = 0; k < 3; k++) {
+        packets[k] = malloc(sizeof(Float3x8) * kNumTriangles / 8);
+        for (int i = 0; i < kNumTriangles; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                packets[k][i / 8].v[axis][i % 8] = triangles[i].vert[k][axis];
+            }
+        }
+    }
+    Float3x4* ray_origins4 = malloc(sizeof(Float3x4) * kNumRays / 4);
+    Float3x4* ray_directions4 = malloc(sizeof(Float3x4) * kNumRays / 4);
+    Float3x8* ray_origins = malloc(sizeof(Float3x8) * kNumRays / 8);
+    Float3x8* ray_directions = malloc(sizeof(Float3x8) * kNumRays / 8);
+    for (int i = 0; i < kNumRays; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            ray_origins4[i / 4].v[axis][i % 4] = origins[i][axis];
+            ray_directions4[i / 4].v[axis][i % 4] = directions[i][axis];
+            ray_origins[i / 8].v[axis][i % 8] = origins[i][axis];
+            ray_directions[i / 8].v[axis][i % 8] = directions[i][axis];
+        }
+    }
+
+    const size_t num_tests = (size_t)kNumRays * kNumTriangles;
+    bool* hits = malloc(num_tests);
+    float* ts = malloc(sizeof(float) * num_tests);
+    float t[8], u[8], v[8];
+    int mismatches = 0;
+    int num_hits = 0;
+
+    uint64_t start = stm_now();
+    for (int ray = 0; ray < kNumRays; ray++) {
+        for (int tri = 0; tri < kNumTriangles; tri++) {
+            const size_t index = (size_t)ray * kNumTriangles + tri;
+            const Triangle* tr = &triangles[tri];
+            hits[index] = intersect_triangle(origins[ray], directions[ray], tr->vert[0],
+                                             tr->vert[1], tr->vert[2], t, u, v);
+            ts[index] = t[0];
+            num_hits += hits[index];
+        }
+    }
+    const double scalar_ms = stm_ms(stm_diff(stm_now(), start));
+
+    start = stm_now();
+    for (int ray = 0; ray < kNumRays; ray++) {
+        for (int tri = 0; tri < kNumTriangles; tri += 4) {
+            Float3x4 quad[3];
+            for (int k = 0; k < 3; k++) {
+                for (int axis = 0; axis < 3; axis++) {
+                    memcpy(quad[k].v[axis], &packets[k][tri / 8].v[axis][tri % 8],
+                           sizeof(float) * 4);
+                }
+            }
+            const int mask = intersect_triangle4(origins[ray], directions[ray], &quad[0],
+                                                 &quad[1], &quad[2], t, u, v);
+            for (int lane = 0; lane < 4; lane++) {
+                mismatches += check(hits, ts, ray, tri + lane, mask, lane, t);
+            }
+        }
+    }
+    const double tri4_ms = stm_ms(stm_diff(stm_now(), start));
+
+    start = stm_now();
+    for (int ray = 0; ray < kNumRays; ray++) {
+        for (int tri = 0; tri < kNumTriangles; tri += 8) {
+            const int mask =
+                intersect_triangle8(origins[ray], directions[ray], &packets[0][tri / 8],
+                                    &packets[1][tri / 8], &packets[2][tri / 8], t, u, v);
+            for (int lane = 0; lane < 8; lane++) {
+                mismatches += check(hits, ts, ray, tri + lane, mask, lane, t);
+            }
+        }
+    }
+    const double tri8_ms = stm_ms(stm_diff(stm_now(), start));
+
+    start = stm_now();
+    for (int tri = 0; tri < kNumTriangles; tri++) {
+        const Triangle* tr = &triangles[tri];
+        for (int ray = 0; ray < kNumRays; ray += 4) {
+            const int mask = intersect_rays4(&ray_origins4[ray / 4], &ray_directions4[ray / 4],
+                                             tr->vert[0], tr->vert[1], tr->vert[2], t, u, v);
+            for (int lane = 0; lane < 4; lane++) {
+                mismatches += check(hits, ts, ray + lane, tri, mask, lane, t);
+            }
+        }
+    }
+    const double rays4_ms = stm_ms(stm_diff(stm_now(), start));
+
+    start = stm_now();
+    for (int tri = 0; tri < kNumTriangles; tri++) {
+        const Triangle* tr = &triangles[tri];
+        for (int ray = 0; ray < kNumRays; ray += 8) {
+            const int mask = intersect_rays8(&ray_origins[ray / 8], &ray_directions[ray / 8],
+                                             tr->vert[0], tr->vert[1], tr->vert[2], t, u, v);
+            for (int lane = 0; lane < 8; lane++) {
+                mismatches += check(hits, ts, ray + lane, tri, mask, lane, t);
+            }
+        }
+    }
+    const double rays8_ms = stm_ms(stm_diff(stm_now(), start));
+
+    printf("%d rays x %d triangles, %d hits, %d mismatches\n", kNumRays, kNumTriangles, num_hits,
+           mismatches);
+    printf("scalar               %7.1f ms  %6.1f Mtests/s\n", scalar_ms,
+           num_tests / scalar_ms / 1e3);
+    printf("1 ray x 4 triangles  %7.1f ms  %6.1f Mtests/s\n", tri4_ms, num_tests / tri4_ms / 1e3);
+    printf("1 ray x 8 triangles  %7.1f ms  %6.1f Mtests/s\n", tri8_ms, num_tests / tri8_ms / 1e3);
+    printf("4 rays x 1 triangle  %7.1f ms  %6.1f Mtests/s\n", rays4_ms, num_tests / rays4_ms / 1e3);
+    printf("8 rays x 1 triangle  %7.1f ms  %6.1f Mtests/s\n", rays8_ms, num_tests / rays8_ms / 1e3);
+
+    bench_quads(origins, directions);
+    bench_boxes(origins, directions);
+    const int box_mismatches = check_parallel_boxes();
+    printf("%d mismatches for rays parallel to a box face\n", box_mismatches);
+    return mismatches || box_mismatches ? 1 : 0;
+}
@@ -0,0 +1,44 @@
+// Ray-Triangle Intersection Test Routine
+// Tomas Moller and Ben Trumbore
+
+#include "ray_double.h"
+#include "vec_double.h"
+
+#define EPSILON 0.000000000001
+
+bool intersect_triangle_double(const double orig[3], const double dir[3], const double vert0[3],
+                               const double vert1[3], const double vert2[3], double* t, double* u,
+                               double* v) {
+    double edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];
+
+    /* find vectors for two edges sharing vert0 */
+    double3_subtract(edge1, vert1, vert0);
+    double3_subtract(edge2, vert2, vert0);
+
+    /* begin calculating determinant - also used to calculate U parameter */
+    double3_cross(pvec, dir, edge2);
+
+    /* if determinant is near zero, ray lies in plane of triangle */
+    const double det = double3_dot(edge1, pvec);
+    if (det > -EPSILON && det < EPSILON) return false;
+    const double inv_det = 1.0 / det;
+
+    /* calculate distance from vert0 to ray origin */
+    double3_subtract(tvec, orig, vert0);
+
+    /* calculate U parameter and test bounds */
+    *u = double3_dot(tvec, pvec) * inv_det;
+    if (*u < 0.0 || *u > 1.0) return false;
+
+    /* prepare to test V parameter */
+    double3_cross(qvec, tvec, edge1);
+
+    /* calculate V parameter and test bounds */
+    *v = double3_dot(dir, qvec) * inv_det;
+    if (*v < 0.0 || *u + *v > 1.0) return false;
+
+    /* calculate t, ray intersects triangle */
+    *t = double3_dot(edge2, qvec) * inv_det;
+
+    return true;
+}
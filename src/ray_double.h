@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Double precision variant of intersect_triangle. Hit semantics are the same, except that the
+// threshold for rays parallel to the triangle is much smaller.
+bool intersect_triangle_double(const double orig[3], const double dir[3], const double vert0[3],
+                               const double vert1[3], const double vert2[3], double* t, double* u,
+                               double* v);
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,11 +2,15 @@
 // Tomas Moller and Ben Trumbore
 
 #include "ray_float.h"
-#include "vec_float.h"
 
 #include <math.h>
 
-#define EPSILON 0.000001
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Single precision so that the batched kernels below can match the scalar test bit for bit.
+#define EPSILON 0.000001f
 #define CROSS(dest, v1, v2)                  \
     dest[0] = v1[1] * v2[2] - v1[2] * v2[1]; \
     dest[1] = v1[2] * v2[0] - v1[0] * v2[2]; \
@@ -33,21 +37,21 @@ bool intersect_triangle(const float orig[3], const float dir[3], const float ver
     det = DOT(edge1, pvec);
 
     if (det > -EPSILON && det < EPSILON) return false;
-    inv_det = 1.0 / det;
+    inv_det = 1.0f / det;
 
     /* calculate distance from vert0 to ray origin */
     SUB(tvec, orig, vert0);
 
     /* calculate U parameter and test bounds */
     *u = DOT(tvec, pvec) * inv_det;
-    if (*u < 0.0 || *u > 1.0) return false;
+    if (*u < 0.0f || *u > 1.0f) return false;
 
     /* prepare to test V parameter */
     CROSS(qvec, tvec, edge1);
 
     /* calculate V parameter and test bounds */
     *v = DOT(dir, qvec) * inv_det;
-    if (*v < 0.0 || *u + *v > 1.0) return false;
+    if (*v < 0.0f || *u + *v > 1.0f) return false;
 
     /* calculate t, ray intersects triangle */
     *t = DOT(edge2, qvec) * inv_det;
@@ -55,105 +59,362 @@ bool intersect_triangle(const float orig[3], const float dir[3], const float ver
     return true;
 }
 
-static void compute_bilinear_coord(const float orig[3], const float dir[3], float t,
-                                   const float sw[3], const float se[3], const float ne[3],
-                                   const float nw[3], float* u, float* v) {
-    float p[3];
-    float3_copy(p, dir);
-    float3_scale(p, t);
-    float3_add(p, p, orig);
-
-    float pvec[3];
-    float3_subtract(pvec, p, sw);
+// The batched kernels evaluate exactly the same operations as intersect_triangle, in the same
+// order, with each rejection test turned into a lane mask.
+
+#if defined(__SSE2__)
+
+#define CROSS4(dest, v1, v2)                                                       \
+    dest[0] = _mm_sub_ps(_mm_mul_ps(v1[1], v2[2]), _mm_mul_ps(v1[2], v2[1])); \
+    dest[1] = _mm_sub_ps(_mm_mul_ps(v1[2], v2[0]), _mm_mul_ps(v1[0], v2[2])); \
+    dest[2] = _mm_sub_ps(_mm_mul_ps(v1[0], v2[1]), _mm_mul_ps(v1[1], v2[0]));
+#define DOT4(v1, v2)                                                            \
+    _mm_add_ps(_mm_add_ps(_mm_mul_ps(v1[0], v2[0]), _mm_mul_ps(v1[1], v2[1])), \
+               _mm_mul_ps(v1[2], v2[2]))
+#define SUB4(dest, v1, v2)                \
+    dest[0] = _mm_sub_ps(v1[0], v2[0]); \
+    dest[1] = _mm_sub_ps(v1[1], v2[1]); \
+    dest[2] = _mm_sub_ps(v1[2], v2[2]);
+
+static int intersect4(const __m128 orig[3], const __m128 dir[3], const __m128 vert0[3],
+                      const __m128 vert1[3], const __m128 vert2[3], float t[4], float u[4],
+                      float v[4]) {
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    __m128 edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];
+
+    SUB4(edge1, vert1, vert0);
+    SUB4(edge2, vert2, vert0);
+    CROSS4(pvec, dir, edge2);
+    const __m128 det = DOT4(edge1, pvec);
+    __m128 miss = _mm_and_ps(_mm_cmpgt_ps(det, _mm_set1_ps(-EPSILON)),
+                             _mm_cmplt_ps(det, _mm_set1_ps(EPSILON)));
+    const __m128 inv_det = _mm_div_ps(one, det);
+
+    SUB4(tvec, orig, vert0);
+    const __m128 u4 = _mm_mul_ps(DOT4(tvec, pvec), inv_det);
+    miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(u4, zero), _mm_cmpgt_ps(u4, one)));
+
+    CROSS4(qvec, tvec, edge1);
+    const __m128 v4 = _mm_mul_ps(DOT4(dir, qvec), inv_det);
+    miss = _mm_or_ps(miss, _mm_or_ps(_mm_cmplt_ps(v4, zero),
+                                     _mm_cmpgt_ps(_mm_add_ps(u4, v4), one)));
+
+    _mm_storeu_ps(t, _mm_mul_ps(DOT4(edge2, qvec), inv_det));
+    _mm_storeu_ps(u, u4);
+    _mm_storeu_ps(v, v4);
+    return ~_mm_movemask_ps(miss) & 0xf;
+}
 
-    float udir[3];
-    float3_subtract(udir, se, sw);
+#endif
 
-    float vdir[3];
-    float3_subtract(vdir, nw, sw);
+#if defined(__AVX__)
+
+#define CROSS8(dest, v1, v2)                                                             \
+    dest[0] = _mm256_sub_ps(_mm256_mul_ps(v1[1], v2[2]), _mm256_mul_ps(v1[2], v2[1])); \
+    dest[1] = _mm256_sub_ps(_mm256_mul_ps(v1[2], v2[0]), _mm256_mul_ps(v1[0], v2[2])); \
+    dest[2] = _mm256_sub_ps(_mm256_mul_ps(v1[0], v2[1]), _mm256_mul_ps(v1[1], v2[0]));
+#define DOT8(v1, v2)                                                                    \
+    _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(v1[0], v2[0]), _mm256_mul_ps(v1[1], v2[1])), \
+                  _mm256_mul_ps(v1[2], v2[2]))
+#define SUB8(dest, v1, v2)                   \
+    dest[0] = _mm256_sub_ps(v1[0], v2[0]); \
+    dest[1] = _mm256_sub_ps(v1[1], v2[1]); \
+    dest[2] = _mm256_sub_ps(v1[2], v2[2]);
+
+static int intersect8(const __m256 orig[3], const __m256 dir[3], const __m256 vert0[3],
+                      const __m256 vert1[3], const __m256 vert2[3], float t[8], float u[8],
+                      float v[8]) {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    __m256 edge1[3], edge2[3], tvec[3], pvec[3], qvec[3];
+
+    SUB8(edge1, vert1, vert0);
+    SUB8(edge2, vert2, vert0);
+    CROSS8(pvec, dir, edge2);
+    const __m256 det = DOT8(edge1, pvec);
+    __m256 miss = _mm256_and_ps(_mm256_cmp_ps(det, _mm256_set1_ps(-EPSILON), _CMP_GT_OQ),
+                                _mm256_cmp_ps(det, _mm256_set1_ps(EPSILON), _CMP_LT_OQ));
+    const __m256 inv_det = _mm256_div_ps(one, det);
+
+    SUB8(tvec, orig, vert0);
+    const __m256 u8 = _mm256_mul_ps(DOT8(tvec, pvec), inv_det);
+    miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(u8, zero, _CMP_LT_OQ),
+                                           _mm256_cmp_ps(u8, one, _CMP_GT_OQ)));
+
+    CROSS8(qvec, tvec, edge1);
+    const __m256 v8 = _mm256_mul_ps(DOT8(dir, qvec), inv_det);
+    miss = _mm256_or_ps(miss, _mm256_or_ps(_mm256_cmp_ps(v8, zero, _CMP_LT_OQ),
+                                           _mm256_cmp_ps(_mm256_add_ps(u8, v8), one, _CMP_GT_OQ)));
+
+    _mm256_storeu_ps(t, _mm256_mul_ps(DOT8(edge2, qvec), inv_det));
+    _mm256_storeu_ps(u, u8);
+    _mm256_storeu_ps(v, v8);
+    return ~_mm256_movemask_ps(miss) & 0xff;
+}
 
-    const float ulen2 = float3_dot(udir, udir);
-    const float vlen2 = float3_dot(vdir, vdir);
+#else
 
-    *u = float3_dot(pvec, udir) / ulen2;
-    *v = float3_dot(pvec, vdir) / vlen2;
+// Copies lanes [first, first + 4) out of an 8-wide vector.
+static Float3x4 take4(const Float3x8* src, int first) {
+    Float3x4 dst;
+    for (int i = 0; i < 3; i++) {
+        for (int lane = 0; lane < 4; lane++) {
+            dst.v[i][lane] = src->v[i][first + lane];
+        }
+    }
+    return dst;
 }
 
-// TODO: use the Lagae and Dutré method instead
-bool intersect_quad(const float orig[3], const float dir[3], const float sw[3], const float se[3],
-                    const float ne[3], const float nw[3], float* t, float* u, float* v) {
-    bool t0 = intersect_triangle(orig, dir, sw, se, ne, t, u, v);
-    if (t0) {
-        compute_bilinear_coord(orig, dir, *t, sw, se, ne, nw, u, v);
-        return true;
+#endif
+
+int intersect_triangle4(const float orig[3], const float dir[3], const Float3x4* vert0,
+                        const Float3x4* vert1, const Float3x4* vert2, float t[4], float u[4],
+                        float v[4]) {
+#if defined(__SSE2__)
+    __m128 o[3], d[3], a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm_set1_ps(orig[i]);
+        d[i] = _mm_set1_ps(dir[i]);
+        a[i] = _mm_loadu_ps(vert0->v[i]);
+        b[i] = _mm_loadu_ps(vert1->v[i]);
+        c[i] = _mm_loadu_ps(vert2->v[i]);
     }
-    bool t1 = intersect_triangle(orig, dir, ne, nw, sw, t, u, v);
-    if (t1) {
-        compute_bilinear_coord(orig, dir, *t, sw, se, ne, nw, u, v);
-        return true;
+    return intersect4(o, d, a, b, c, t, u, v);
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        const float a[3] = {vert0->v[0][lane], vert0->v[1][lane], vert0->v[2][lane]};
+        const float b[3] = {vert1->v[0][lane], vert1->v[1][lane], vert1->v[2][lane]};
+        const float c[3] = {vert2->v[0][lane], vert2->v[1][lane], vert2->v[2][lane]};
+        if (intersect_triangle(orig, dir, a, b, c, t + lane, u + lane, v + lane)) {
+            mask |= 1 << lane;
+        }
     }
-    return false;
+    return mask;
+#endif
 }
 
-#if 0
-static bool parcc_raycast_aabb(const parcc_float origin[3], const parcc_float dir[3],
-                               parcc_float* t, void* userdata) {
-    typedef struct parcc_vec3 {
-        parcc_float x, y, z;
-    } parcc_vec3;
-    parcc_context* context = (parcc_context*)userdata;
-    const parcc_vec3 minc = *((parcc_vec3*)context->props.orbit_aabb.min_corner);
-    const parcc_vec3 maxc = *((parcc_vec3*)context->props.orbit_aabb.max_corner);
-
-    // The front face is defined in CCW order and the back face is defined in CW order.
-    // Both start at the lower-left corner.
-
-    const parcc_float fr[4][3] = {
-        {minc.x, minc.y, maxc.z},
-        {maxc.x, minc.y, maxc.z},
-        {maxc.x, maxc.y, maxc.z},
-        {minc.x, maxc.y, maxc.z},
-    };
-
-    const parcc_float bk[4][3] = {
-        {minc.x, minc.y, minc.z},
-        {minc.x, maxc.y, minc.z},
-        {maxc.x, maxc.y, minc.z},
-        {maxc.x, minc.y, minc.z},
-    };
-
-    float u, v;
-
-    // Front
-    if (intersect_quad(origin, dir, fr[0], fr[1], fr[2], fr[3], t, &u, &v)) {
-        return true;
+int intersect_triangle8(const float orig[3], const float dir[3], const Float3x8* vert0,
+                        const Float3x8* vert1, const Float3x8* vert2, float t[8], float u[8],
+                        float v[8]) {
+#if defined(__AVX__)
+    __m256 o[3], d[3], a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm256_set1_ps(orig[i]);
+        d[i] = _mm256_set1_ps(dir[i]);
+        a[i] = _mm256_loadu_ps(vert0->v[i]);
+        b[i] = _mm256_loadu_ps(vert1->v[i]);
+        c[i] = _mm256_loadu_ps(vert2->v[i]);
     }
+    return intersect8(o, d, a, b, c, t, u, v);
+#else
+    int mask = 0;
+    for (int first = 0; first < 8; first += 4) {
+        const Float3x4 a = take4(vert0, first);
+        const Float3x4 b = take4(vert1, first);
+        const Float3x4 c = take4(vert2, first);
+        mask |= intersect_triangle4(orig, dir, &a, &b, &c, t + first, u + first, v + first)
+                << first;
+    }
+    return mask;
+#endif
+}
 
-    // Back
-    if (intersect_quad(origin, dir, bk[0], bk[1], bk[2], bk[3], t, &u, &v)) {
-        return true;
+int intersect_rays4(const Float3x4* orig, const Float3x4* dir, const float vert0[3],
+                    const float vert1[3], const float vert2[3], float t[4], float u[4],
+                    float v[4]) {
+#if defined(__SSE2__)
+    __m128 o[3], d[3], a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm_loadu_ps(orig->v[i]);
+        d[i] = _mm_loadu_ps(dir->v[i]);
+        a[i] = _mm_set1_ps(vert0[i]);
+        b[i] = _mm_set1_ps(vert1[i]);
+        c[i] = _mm_set1_ps(vert2[i]);
+    }
+    return intersect4(o, d, a, b, c, t, u, v);
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        const float o[3] = {orig->v[0][lane], orig->v[1][lane], orig->v[2][lane]};
+        const float d[3] = {dir->v[0][lane], dir->v[1][lane], dir->v[2][lane]};
+        if (intersect_triangle(o, d, vert0, vert1, vert2, t + lane, u + lane, v + lane)) {
+            mask |= 1 << lane;
+        }
     }
+    return mask;
+#endif
+}
 
-    // Right
-    if (intersect_quad(origin, dir, fr[2], fr[1], bk[3], bk[2], t, &u, &v)) {
-        return true;
+int intersect_rays8(const Float3x8* orig, const Float3x8* dir, const float vert0[3],
+                    const float vert1[3], const float vert2[3], float t[8], float u[8],
+                    float v[8]) {
+#if defined(__AVX__)
+    __m256 o[3], d[3], a[3], b[3], c[3];
+    for (int i = 0; i < 3; i++) {
+        o[i] = _mm256_loadu_ps(orig->v[i]);
+        d[i] = _mm256_loadu_ps(dir->v[i]);
+        a[i] = _mm256_set1_ps(vert0[i]);
+        b[i] = _mm256_set1_ps(vert1[i]);
+        c[i] = _mm256_set1_ps(vert2[i]);
     }
+    return intersect8(o, d, a, b, c, t, u, v);
+#else
+    int mask = 0;
+    for (int first = 0; first < 8; first += 4) {
+        const Float3x4 o = take4(orig, first);
+        const Float3x4 d = take4(dir, first);
+        mask |= intersect_rays4(&o, &d, vert0, vert1, vert2, t + first, u + first, v + first)
+                << first;
+    }
+    return mask;
+#endif
+}
+
+// Lagae and Dutré, "An Efficient Ray-Quadrilateral Intersection Test", JGT 2005. Finds t and the
+// bilinear coordinates in a single pass. The quad must be planar and convex.
+bool intersect_quad(const float orig[3], const float dir[3], const float sw[3], const float se[3],
+                    const float ne[3], const float nw[3], float* t, float* u, float* v) {
+    float e01[3], e03[3], tvec[3], pvec[3], qvec[3];
 
-    // Left
-    if (intersect_quad(origin, dir, fr[3], bk[1], bk[0], fr[0], t, &u, &v)) {
-        return true;
+    /* reject rays using the barycentric coordinates of the hit with respect to sw, se, nw */
+    SUB(e01, se, sw);
+    SUB(e03, nw, sw);
+    CROSS(pvec, dir, e03);
+    const float det = DOT(e01, pvec);
+    if (det > -EPSILON && det < EPSILON) return false;
+    const float inv_det = 1.0f / det;
+    SUB(tvec, orig, sw);
+    const float alpha = DOT(tvec, pvec) * inv_det;
+    if (alpha < 0.0f) return false;
+    CROSS(qvec, tvec, e01);
+    const float beta = DOT(dir, qvec) * inv_det;
+    if (beta < 0.0f) return false;
+
+    /* if the hit is outside that triangle, test it against the opposite one */
+    if (alpha + beta > 1.0f) {
+        float e23[3], e21[3], tvec2[3], pvec2[3], qvec2[3];
+        SUB(e23, nw, ne);
+        SUB(e21, se, ne);
+        CROSS(pvec2, dir, e21);
+        const float det2 = DOT(e23, pvec2);
+        if (det2 > -EPSILON && det2 < EPSILON) return false;
+        const float inv_det2 = 1.0f / det2;
+        SUB(tvec2, orig, ne);
+        if (DOT(tvec2, pvec2) * inv_det2 < 0.0f) return false;
+        CROSS(qvec2, tvec2, e23);
+        if (DOT(dir, qvec2) * inv_det2 < 0.0f) return false;
     }
 
-    // Bottom
-    if (intersect_quad(origin, dir, bk[0], bk[3], fr[1], fr[0], t, &u, &v)) {
-        return true;
+    *t = DOT(e03, qvec) * inv_det;
+    if (*t < 0.0f) return false;
+
+    /* barycentric coordinates of ne, computed in the plane of largest projected area */
+    float e02[3], n[3];
+    SUB(e02, ne, sw);
+    CROSS(n, e01, e03);
+    float alpha11, beta11;
+    if (fabsf(n[0]) >= fabsf(n[1]) && fabsf(n[0]) >= fabsf(n[2])) {
+        alpha11 = (e02[1] * e03[2] - e02[2] * e03[1]) / n[0];
+        beta11 = (e01[1] * e02[2] - e01[2] * e02[1]) / n[0];
+    } else if (fabsf(n[1]) >= fabsf(n[2])) {
+        alpha11 = (e02[2] * e03[0] - e02[0] * e03[2]) / n[1];
+        beta11 = (e01[2] * e02[0] - e01[0] * e02[2]) / n[1];
+    } else {
+        alpha11 = (e02[0] * e03[1] - e02[1] * e03[0]) / n[2];
+        beta11 = (e01[0] * e02[1] - e01[1] * e02[0]) / n[2];
     }
 
-    // Top
-    if (intersect_quad(origin, dir, bk[1], fr[3], fr[2], bk[2], t, &u, &v)) {
-        return true;
+    /* bilinear coordinates of the hit; parallelograms and trapezoids avoid the quadratic */
+    if (fabsf(alpha11 - 1.0f) < EPSILON) {
+        *u = alpha;
+        *v = fabsf(beta11 - 1.0f) < EPSILON ? beta : beta / (*u * (beta11 - 1.0f) + 1.0f);
+    } else if (fabsf(beta11 - 1.0f) < EPSILON) {
+        *v = beta;
+        *u = alpha / (*v * (alpha11 - 1.0f) + 1.0f);
+    } else {
+        const float a = 1.0f - beta11;
+        const float b = alpha * (beta11 - 1.0f) - beta * (alpha11 - 1.0f) - 1.0f;
+        const float c = alpha;
+        const float discriminant = fmaxf(b * b - 4.0f * a * c, 0.0f);
+        const float q = -0.5f * (b + copysignf(sqrtf(discriminant), b));
+        *u = q / a;
+        if (*u < 0.0f || *u > 1.0f) {
+            *u = c / q;
+        }
+        *v = beta / (*u * (beta11 - 1.0f) + 1.0f);
     }
+    return true;
+}
 
-    return false;
+// Unlike fminf / fmaxf these compile to single min / max instructions, since they need not
+// handle NaN.
+static inline float min_float(float a, float b) { return a < b ? a : b; }
+static inline float max_float(float a, float b) { return a > b ? a : b; }
+
+// Slab test. On an axis where dir is zero the ray is parallel to the slab, and the slab distances
+// would be infinite or, with the origin exactly on a plane, 0 * inf = NaN. So that axis only
+// checks that the origin lies between the planes.
+bool intersect_aabb(const float orig[3], const float dir[3], const float min_corner[3],
+                    const float max_corner[3], float* t) {
+    float t_enter = -INFINITY;
+    float t_exit = INFINITY;
+    for (int i = 0; i < 3; i++) {
+        if (dir[i] == 0.0f) {
+            if (orig[i] < min_corner[i] || orig[i] > max_corner[i]) {
+                return false;
+            }
+            continue;
+        }
+        const float inv_dir = 1.0f / dir[i];
+        const float t0 = (min_corner[i] - orig[i]) * inv_dir;
+        const float t1 = (max_corner[i] - orig[i]) * inv_dir;
+        t_enter = max_float(t_enter, min_float(t0, t1));
+        t_exit = min_float(t_exit, max_float(t0, t1));
+    }
+    *t = t_enter >= 0.0f ? t_enter : t_exit;
+    return t_exit >= max_float(t_enter, 0.0f);
 }
+
+int intersect_aabb4(const float orig[3], const float dir[3], const Float3x4* min_corner,
+                    const Float3x4* max_corner, float t[4]) {
+#if defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    __m128 t_enter = _mm_set1_ps(-INFINITY);
+    __m128 t_exit = _mm_set1_ps(INFINITY);
+    __m128 parallel_inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int i = 0; i < 3; i++) {
+        const __m128 o = _mm_set1_ps(orig[i]);
+        if (dir[i] == 0.0f) {
+            // Same as the scalar version: the boxes are only hit if the origin is between the
+            // planes.
+            const __m128 above_min = _mm_cmple_ps(_mm_loadu_ps(min_corner->v[i]), o);
+            const __m128 below_max = _mm_cmpge_ps(_mm_loadu_ps(max_corner->v[i]), o);
+            parallel_inside = _mm_and_ps(parallel_inside, _mm_and_ps(above_min, below_max));
+            continue;
+        }
+        const __m128 inv_dir = _mm_set1_ps(1.0f / dir[i]);
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(min_corner->v[i]), o), inv_dir);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(max_corner->v[i]), o), inv_dir);
+        t_enter = _mm_max_ps(t_enter, _mm_min_ps(t0, t1));
+        t_exit = _mm_min_ps(t_exit, _mm_max_ps(t0, t1));
+    }
+    const __m128 inside = _mm_cmplt_ps(t_enter, zero);
+    _mm_storeu_ps(t, _mm_or_ps(_mm_and_ps(inside, t_exit), _mm_andnot_ps(inside, t_enter)));
+    const __m128 hit = _mm_cmpge_ps(t_exit, _mm_max_ps(t_enter, zero));
+    return _mm_movemask_ps(_mm_and_ps(hit, parallel_inside));
+#else
+    int mask = 0;
+    for (int lane = 0; lane < 4; lane++) {
+        const float minc[3] = {min_corner->v[0][lane], min_corner->v[1][lane],
+                               min_corner->v[2][lane]};
+        const float maxc[3] = {max_corner->v[0][lane], max_corner->v[1][lane],
+                               max_corner->v[2][lane]};
+        if (intersect_aabb(orig, dir, minc, maxc, t + lane)) {
+            mask |= 1 << lane;
+        }
+    }
+    return mask;
 #endif
+}
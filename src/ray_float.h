@@ -9,10 +9,45 @@ extern "C" {
 bool intersect_triangle(const float orig[3], const float dir[3], const float vert0[3],
                         const float vert1[3], const float vert2[3], float* t, float* u, float* v);
 
-// Vertices must be in ccw order
+// Three-component vectors in structure-of-arrays layout, indexed as v[axis][lane].
+typedef struct {
+    float v[3][4];
+} Float3x4;
+
+typedef struct {
+    float v[3][8];
+} Float3x8;
+
+// Batched forms of intersect_triangle with identical hit semantics, testing one ray against
+// several triangles or several rays against one triangle. Returns a bitmask of the lanes that
+// hit; t, u and v are written for every lane but are only meaningful where the bit is set. Pad
+// unused triangle lanes with zeros, which are degenerate and never hit.
+int intersect_triangle4(const float orig[3], const float dir[3], const Float3x4* vert0,
+                        const Float3x4* vert1, const Float3x4* vert2, float t[4], float u[4],
+                        float v[4]);
+int intersect_triangle8(const float orig[3], const float dir[3], const Float3x8* vert0,
+                        const Float3x8* vert1, const Float3x8* vert2, float t[8], float u[8],
+                        float v[8]);
+int intersect_rays4(const Float3x4* orig, const Float3x4* dir, const float vert0[3],
+                    const float vert1[3], const float vert2[3], float t[4], float u[4], float v[4]);
+int intersect_rays8(const Float3x8* orig, const Float3x8* dir, const float vert0[3],
+                    const float vert1[3], const float vert2[3], float t[8], float u[8], float v[8]);
+
+// Vertices must be in cyclic order and the quad must be planar and convex. Unlike
+// intersect_triangle, hits behind the origin are rejected. Returns bilinear coordinates, with u
+// running from sw to se and v from sw to nw.
 bool intersect_quad(const float orig[3], const float dir[3], const float sw[3], const float se[3],
                     const float ne[3], const float nw[3], float* t, float* u, float* v);
 
+// Finds where the ray enters an axis-aligned box, or where it exits if the origin is inside.
+bool intersect_aabb(const float orig[3], const float dir[3], const float min_corner[3],
+                    const float max_corner[3], float* t);
+
+// Tests one ray against four boxes and returns a bitmask of the lanes that hit, e.g. for culling
+// chunks before a finer test.
+int intersect_aabb4(const float orig[3], const float dir[3], const Float3x4* min_corner,
+                    const Float3x4* max_corner, float t[4]);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+#define kReplayMagic (0x4c524443)  // "CDRL"
+#define kReplayVersion (1)
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int32_t width;
+    int32_t height;
+} ReplayHeader;
+
+FILE* replay_create(const char* filename, int width, int height) {
+    FILE* fp = fopen(filename, "wb");
+    if (!fp) {
+        return NULL;
+    }
+    const ReplayHeader header = {kReplayMagic, kReplayVersion, width, height};
+    fwrite(&header, sizeof(header), 1, fp);
+    return fp;
+}
+
+void replay_record(FILE* log, double seconds, const sapp_event* event) {
+    const ReplayEvent recorded = {
+        .frame = (uint32_t)event->frame_count,
+        .seconds = (float)seconds,
+        .char_code = event->char_code,
+        .mouse_x = event->mouse_x,
+        .mouse_y = event->mouse_y,
+        .scroll_x = event->scroll_x,
+        .scroll_y = event->scroll_y,
+        .key_code = (uint16_t)event->key_code,
+        .window_width = (uint16_t)event->window_width,
+        .window_height = (uint16_t)event->window_height,
+        .type = (uint8_t)event->type,
+        .modifiers = (uint8_t)event->modifiers,
+        .mouse_button = (int8_t)event->mouse_button,
+        .key_repeat = event->key_repeat,
+    };
+    fwrite(&recorded, sizeof(recorded), 1, log);
+}
+
+bool replay_load(const char* filename, ReplayLog* log) {
+    memset(log, 0, sizeof(*log));
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return false;
+    }
+    ReplayHeader header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != kReplayMagic ||
+        header.version != kReplayVersion) {
+        fclose(fp);
+        return false;
+    }
+    log->width = header.width;
+    log->height = header.height;
+
+    size_t capacity = 0;
+    ReplayEvent recorded;
+    while (fread(&recorded, sizeof(recorded), 1, fp) == 1) {
+        if (log->num_events == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            log->events = realloc(log->events, capacity * sizeof(ReplayEvent));
+        }
+        log->events[log->num_events++] = recorded;
+    }
+    fclose(fp);
+    return true;
+}
+
+void replay_free(ReplayLog* log) {
+    free(log->events);
+    memset(log, 0, sizeof(*log));
+}
+
+void replay_get_event(const ReplayEvent* recorded, sapp_event* event) {
+    memset(event, 0, sizeof(*event));
+    event->frame_count = recorded->frame;
+    event->type = (sapp_event_type)recorded->type;
+    event->key_code = (sapp_keycode)recorded->key_code;
+    event->char_code = recorded->char_code;
+    event->key_repeat = recorded->key_repeat;
+    event->modifiers = recorded->modifiers;
+    event->mouse_button = (sapp_mousebutton)recorded->mouse_button;
+    event->mouse_x = recorded->mouse_x;
+    event->mouse_y = recorded->mouse_y;
+    event->scroll_x = recorded->scroll_x;
+    event->scroll_y = recorded->scroll_y;
+    event->window_width = recorded->window_width;
+    event->window_height = recorded->window_height;
+    event->framebuffer_width = recorded->window_width;
+    event->framebuffer_height = recorded->window_height;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sokol/sokol_app.h>
+
+// Replays run on a virtual clock that advances by this much per frame.
+#define kReplayFrameSeconds (1.0 / 60.0)
+
+// One recorded sapp_event, plus the frame it arrived before. Touches and the framebuffer size are
+// left out because the app does not use them. Logs are written in native byte order, so they are
+// meant to be replayed on the machine that recorded them.
+typedef struct {
+    uint32_t frame;
+    float seconds;
+    uint32_t char_code;
+    float mouse_x;
+    float mouse_y;
+    float scroll_x;
+    float scroll_y;
+    uint16_t key_code;
+    uint16_t window_width;
+    uint16_t window_height;
+    uint8_t type;
+    uint8_t modifiers;
+    int8_t mouse_button;
+    uint8_t key_repeat;
+    uint16_t unused;
+} ReplayEvent;
+
+typedef struct {
+    int width;
+    int height;
+    ReplayEvent* events;
+    size_t num_events;
+} ReplayLog;
+
+// Opens a log for writing and records the initial window size. Returns NULL on failure.
+FILE* replay_create(const char* filename, int width, int height);
+
+// Appends an event, timestamped in seconds since recording started.
+void replay_record(FILE* log, double seconds, const sapp_event* event);
+
+// Reads an entire log into memory. Returns false if the file is missing or malformed.
+bool replay_load(const char* filename, ReplayLog* log);
+void replay_free(ReplayLog* log);
+
+// Expands a recorded event back into the form that sokol_app delivers.
+void replay_get_event(const ReplayEvent* recorded, sapp_event* event);
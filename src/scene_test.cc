@@ -0,0 +1,77 @@
+// Checks the instance bookkeeping of part_scene: removed ids must be rejected by the calls that
+// take an id, and must never be handed out twice.
+
+#define NANO_RT_C_IMPLEMENTATION 1
+#include <nanort/nanort_c.h>
+
+#include <cstdio>
+
+static int num_failures = 0;
+
+static void expect(bool condition, const char* what) {
+    if (!condition) {
+        printf("FAILED: %s\n", what);
+        num_failures++;
+    }
+}
+
+static void translation(float m[16], float x, float y, float z) {
+    for (int i = 0; i < 16; i++) {
+        m[i] = i % 5 == 0 ? 1.0f : 0.0f;
+    }
+    m[12] = x;
+    m[13] = y;
+    m[14] = z;
+}
+
+// Traces straight down through (x, y) and returns the instance hit, or -1.
+static int trace_down(const part_scene* scene, float x, float y) {
+    part_ray ray = {{x, y, 10.0f}, {0.0f, 0.0f, -1.0f}, 0.0f, 100.0f};
+    part_scene_intersection isect;
+    return part_scene_trace(scene, ray, &isect) ? (int)isect.instance_id : -1;
+}
+
+int main() {
+    // A unit square in the XY plane.
+    const float vertices[] = {0, 0, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0};
+    const uint16_t triangles[] = {0, 1, 2, 0, 2, 3};
+    const part_mesh mesh = {vertices, 4, triangles, 2};
+    part_config config = {};
+    part_context* square = part_create_context(config, mesh, nullptr);
+
+    part_scene* scene = part_create_scene();
+    float m[16];
+    translation(m, 0, 0, 0);
+    const uint32_t a = part_scene_add(scene, square, m);
+    translation(m, 2, 0, 0);
+    const uint32_t b = part_scene_add(scene, square, m);
+    part_scene_commit(scene);
+    expect(trace_down(scene, 0.5f, 0.5f) == (int)a, "hit the first instance");
+    expect(trace_down(scene, 2.5f, 0.5f) == (int)b, "hit the second instance");
+
+    // Remove, then move the removed instance and remove it again.
+    expect(part_scene_remove(scene, a), "remove a live instance");
+    translation(m, 4, 0, 0);
+    expect(!part_scene_set_transform(scene, a, m), "reject moving a removed instance");
+    expect(!part_scene_remove(scene, a), "reject removing an instance twice");
+    expect(!part_scene_remove(scene, 1000), "reject an id that was never added");
+    expect(trace_down(scene, 0.5f, 0.5f) == -1, "skip a removed instance before the commit");
+    expect(trace_down(scene, 2.5f, 0.5f) == (int)b, "still hit the live instance");
+
+    // The id comes back once, and only after the commit.
+    translation(m, 0, 2, 0);
+    const uint32_t c = part_scene_add(scene, square, m);
+    expect(c != a, "hold back a removed id until the commit");
+    part_scene_commit(scene);
+    const uint32_t d = part_scene_add(scene, square, m);
+    const uint32_t e = part_scene_add(scene, square, m);
+    expect(d == a, "reuse a removed id after the commit");
+    expect(e != d, "hand out a removed id only once");
+
+    part_destroy_scene(scene);
+    part_destroy_context(square);
+    if (num_failures == 0) {
+        printf("All part_scene checks passed\n");
+    }
+    return num_failures ? 1 : 0;
+}
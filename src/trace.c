@@ -0,0 +1,128 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sokol/sokol_time.h>
+
+#include "trace.h"
+
+typedef struct {
+    const char* name;
+    uint64_t start;
+    uint64_t duration;
+} TraceZone;
+
+// A ring of the most recent zones. Only the owning thread writes it, and it publishes each zone by
+// bumping count, so a reader that loads count sees every zone below it fully written.
+typedef struct TraceBuffer {
+    struct TraceBuffer* next;
+    int tid;
+    const char* thread_name;
+    TraceZone zones[kTraceCapacity];
+    _Atomic(uint64_t) count;
+    TraceZone open[kTraceMaxDepth];
+    int depth;
+} TraceBuffer;
+
+static _Atomic(TraceBuffer*) all_buffers = NULL;
+static atomic_int num_threads = 0;
+static _Thread_local TraceBuffer* thread_buffer = NULL;
+
+static TraceBuffer* get_thread_buffer() {
+    if (thread_buffer) {
+        return thread_buffer;
+    }
+    TraceBuffer* buffer = calloc(1, sizeof(TraceBuffer));
+    buffer->tid = atomic_fetch_add(&num_threads, 1) + 1;
+    atomic_init(&buffer->count, 0);
+
+    // Buffers are never freed, so pushing onto the list is the only synchronization needed.
+    TraceBuffer* head = atomic_load(&all_buffers);
+    do {
+        buffer->next = head;
+    } while (!atomic_compare_exchange_weak(&all_buffers, &head, buffer));
+    thread_buffer = buffer;
+    return buffer;
+}
+
+void trace_begin(const char* name) {
+    TraceBuffer* buffer = get_thread_buffer();
+    if (buffer->depth < kTraceMaxDepth) {
+        buffer->open[buffer->depth].name = name;
+        buffer->open[buffer->depth].start = stm_now();
+    }
+    buffer->depth++;
+}
+
+void trace_end() {
+    TraceBuffer* buffer = get_thread_buffer();
+    // An unmatched trace_end has no zone to close.
+    if (buffer->depth <= 0) {
+        return;
+    }
+    buffer->depth--;
+    if (buffer->depth >= kTraceMaxDepth) {
+        return;
+    }
+    const uint64_t count = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    TraceZone zone = buffer->open[buffer->depth];
+    zone.duration = stm_since(zone.start);
+    buffer->zones[count % kTraceCapacity] = zone;
+    atomic_store_explicit(&buffer->count, count + 1, memory_order_release);
+}
+
+void trace_set_thread_name(const char* name) { get_thread_buffer()->thread_name = name; }
+
+// Copies out the zones that a buffer holds. The owner may overwrite the oldest ones during the
+// copy, so any that were recycled by the time it finishes are discarded.
+static uint64_t copy_zones(TraceBuffer* buffer, TraceZone* zones) {
+    const uint64_t end = atomic_load_explicit(&buffer->count, memory_order_acquire);
+    const uint64_t begin = end > kTraceCapacity ? end - kTraceCapacity : 0;
+    for (uint64_t i = begin; i < end; i++) {
+        zones[i - begin] = buffer->zones[i % kTraceCapacity];
+    }
+    atomic_thread_fence(memory_order_acquire);
+    const uint64_t now = atomic_load_explicit(&buffer->count, memory_order_relaxed);
+    const uint64_t valid = now > kTraceCapacity ? now - kTraceCapacity : 0;
+    const uint64_t skip = valid > begin ? valid - begin : 0;
+    const uint64_t count = end - begin > skip ? end - begin - skip : 0;
+    memmove(zones, zones + skip, count * sizeof(TraceZone));
+    return count;
+}
+
+bool trace_dump(const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if (!fp) {
+        return false;
+    }
+    TraceZone* zones = malloc(kTraceCapacity * sizeof(TraceZone));
+    fprintf(fp, "{\"traceEvents\":[\n");
+    const char* separator = "";
+    uint64_t total = 0;
+    for (TraceBuffer* buffer = atomic_load(&all_buffers); buffer; buffer = buffer->next) {
+        if (buffer->thread_name) {
+            fprintf(fp,
+                    "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"name\":\"%s\"}}",
+                    separator, buffer->tid, buffer->thread_name);
+            separator = ",\n";
+        }
+        const uint64_t count = copy_zones(buffer, zones);
+        for (uint64_t i = 0; i < count; i++) {
+            fprintf(fp,
+                    "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"dur\":%.3f}",
+                    separator, zones[i].name, buffer->tid, stm_us(zones[i].start),
+                    stm_us(zones[i].duration));
+            separator = ",\n";
+        }
+        total += count;
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    free(zones);
+    printf("Wrote %llu trace zones to %s\n", (unsigned long long)total, filename);
+    return true;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Each thread keeps its most recent zones, up to this many. Must be a power of two.
+#define kTraceCapacity (1 << 16)
+#define kTraceMaxDepth (32)
+
+// Records a zone on the calling thread's timeline. Zones nest and must be closed in order on the
+// thread that opened them. The name must outlive the trace, e.g. a string literal. Each thread
+// writes into its own buffer, so recording takes no locks. sokol_time must be set up first.
+void trace_begin(const char* name);
+void trace_end(void);
+
+// Labels the calling thread in the exported timeline.
+void trace_set_thread_name(const char* name);
+
+// Writes the zones that every thread still holds as Chrome trace-event JSON. The file can be opened
+// in chrome://tracing or ui.perfetto.dev. Safe to call while other threads record.
+bool trace_dump(const char* filename);
@@ -0,0 +1,262 @@
+// Offline auto-tuner for the raytracer's part_config.
+//
+// Builds the terrain mesh the same way as the app, then sweeps the BVH builder and its parameters.
+// For each config it measures build time, memory and trace throughput over a ray workload. The
+// workload is either recorded by running the app with "record_rays=<file>" or synthesized from
+// the mesh bounds. Prints the Pareto front, then writes the config with the lowest weighted cost
+// to a file that app_init loads. The cost charges build time once, trace time for a session's
+// worth of rays and a penalty per MiB of memory, so all three trade off against each other.
+//
+// Usage: tune_bvh [heightmap.png] [rays.bin] [output.cfg]
+
+#define PAR_MSQUARES_IMPLEMENTATION
+#define STB_IMAGE_IMPLEMENTATION
+#define STBI_ONLY_PNG
+#define NANO_RT_C_IMPLEMENTATION 1
+
+#include <par/par_msquares.h>
+
+#include <stb/stb_image.h>
+
+#include <nanort/nanort_c.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Weights of the cost model: rays traced over a typical session of the app, and the milliseconds of
+// build time that one MiB of BVH memory is worth.
+#define kSessionRays (1000000.0)
+#define kMsPerMiB (2.0)
+
+struct Candidate {
+    part_config config;
+    float build_ms;
+    size_t num_bytes;
+    float sah_cost;
+    float mrays_per_sec;
+    double cost;
+    bool pareto;
+};
+
+static double now_seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+static par_msquares_mesh const* create_mesh(const char* filename) {
+    int nchan;
+    int width, height;
+    stbi_uc* u8_data = stbi_load(filename, &width, &height, &nchan, 1);
+    if (!u8_data) {
+        return NULL;
+    }
+    std::vector<float> float_data(width * height);
+    for (int i = 0; i < width * height; i++) {
+        const float h = (float)u8_data[i] / 255.0f;
+        float_data[i] = 2.0 * h * h * h / 15.0;
+    }
+    stbi_image_free(u8_data);
+
+    // Must match create_mesh in app.c.
+    const int cellsize = 5;
+    par_msquares_meshlist* meshes = par_msquares_grayscale(float_data.data(), width, height,
+                                                           cellsize, 0.0f, PAR_MSQUARES_HEIGHTS);
+    return par_msquares_get_mesh(meshes, 0);
+}
+
+static std::vector<part_ray> load_rays(const char* filename) {
+    std::vector<part_ray> rays;
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) {
+        return rays;
+    }
+    part_ray ray;
+    while (fread(&ray, sizeof(ray), 1, fp) == 1) {
+        rays.push_back(ray);
+    }
+    fclose(fp);
+    return rays;
+}
+
+// Oblique rays from above the terrain toward random points on its footprint, roughly what
+// the orbit camera produces.
+static std::vector<part_ray> synthesize_rays(par_msquares_mesh const* mesh, int count) {
+    float minc[3] = {1e9f, 1e9f, 1e9f};
+    float maxc[3] = {-1e9f, -1e9f, -1e9f};
+    for (int i = 0; i < mesh->npoints * 3; i += 3) {
+        for (int k = 0; k < 3; k++) {
+            minc[k] = std::min(minc[k], mesh->points[i + k]);
+            maxc[k] = std::max(maxc[k], mesh->points[i + k]);
+        }
+    }
+    std::vector<part_ray> rays(count);
+    srand(1);
+    for (int i = 0; i < count; i++) {
+        const float s[4] = {
+            rand() / (float)RAND_MAX, rand() / (float)RAND_MAX,
+            rand() / (float)RAND_MAX, rand() / (float)RAND_MAX,
+        };
+        part_ray& ray = rays[i];
+        ray.org[0] = minc[0] + s[0] * (maxc[0] - minc[0]);
+        ray.org[1] = minc[1] + s[1] * (maxc[1] - minc[1]);
+        ray.org[2] = maxc[2] + 0.5f * (maxc[0] - minc[0]);
+        ray.dir[0] = minc[0] + s[2] * (maxc[0] - minc[0]) - ray.org[0];
+        ray.dir[1] = minc[1] + s[3] * (maxc[1] - minc[1]) - ray.org[1];
+        ray.dir[2] = minc[2] - ray.org[2];
+        ray.min_t = 0.0f;
+        ray.max_t = 9999.0f;
+    }
+    return rays;
+}
+
+// Returns false if the context could not be built with this config.
+static bool measure(part_config config, part_mesh mesh, const std::vector<part_ray>& rays,
+                    Candidate* result_out) {
+    Candidate result = {};
+    result.config = config;
+    part_build_stats stats;
+    part_context* ctx = part_create_context(config, mesh, &stats);
+    if (!ctx) {
+        return false;
+    }
+    result.build_ms = stats.build_secs * 1000.0f;
+    result.num_bytes = stats.num_bytes;
+    result.sah_cost = part_get_sah_cost(ctx);
+
+    // Best of three passes to filter out scheduling noise.
+    double best = 1e9;
+    for (int pass = 0; pass < 3; pass++) {
+        const double start = now_seconds();
+        part_intersection isect;
+        for (size_t i = 0; i < rays.size(); i++) {
+            part_trace(ctx, rays[i], &isect);
+        }
+        best = std::min(best, now_seconds() - start);
+    }
+    result.mrays_per_sec = rays.size() / best / 1e6;
+    result.cost = result.build_ms + kSessionRays / (result.mrays_per_sec * 1e3) +
+                  kMsPerMiB * result.num_bytes / (1024.0 * 1024.0);
+    part_destroy_context(ctx);
+    *result_out = result;
+    return true;
+}
+
+static void add_candidate(std::vector<Candidate>* candidates, part_config config,
+                          part_mesh mesh, const std::vector<part_ray>& rays) {
+    Candidate candidate;
+    if (measure(config, mesh, rays, &candidate)) {
+        candidates->push_back(candidate);
+    } else {
+        fprintf(stderr, "Unable to build a BVH with bins %u, leaf %u, depth %u; skipping\n",
+                config.bin_size, config.min_leaf_primitives, config.max_tree_depth);
+    }
+}
+
+static bool dominates(const Candidate& a, const Candidate& b) {
+    const bool no_worse = a.build_ms <= b.build_ms && a.num_bytes <= b.num_bytes &&
+                          a.mrays_per_sec >= b.mrays_per_sec;
+    const bool better = a.build_ms < b.build_ms || a.num_bytes < b.num_bytes ||
+                        a.mrays_per_sec > b.mrays_per_sec;
+    return no_worse && better;
+}
+
+static void print_candidate(const Candidate& c) {
+    const part_config& cfg = c.config;
+    printf("%-13s bins %2u taabb %.2f leaf %2u depth %3u | build %7.1f ms  %6.0f KiB  "
+           "SAH %6.1f  %6.2f Mrays/s  cost %7.1f%s\n",
+           cfg.builder == PART_BUILDER_LBVH
+               ? (cfg.optimize_treelets ? "lbvh+treelets" : "lbvh")
+               : "binned_sah",
+           cfg.bin_size, cfg.cost_t_aabb, cfg.min_leaf_primitives, cfg.max_tree_depth,
+           c.build_ms, c.num_bytes / 1024.0, c.sah_cost, c.mrays_per_sec, c.cost,
+           c.pareto ? "  *" : "");
+}
+
+int main(int argc, char* argv[]) {
+    const char* heightmap = argc > 1 ? argv[1] : "extras/terrain/landmass.png";
+    const char* ray_file = argc > 2 ? argv[2] : NULL;
+    const char* output = argc > 3 ? argv[3] : "extras/terrain/bvh.cfg";
+
+    par_msquares_mesh const* msquares = create_mesh(heightmap);
+    if (!msquares) {
+        fprintf(stderr, "Unable to load %s\n", heightmap);
+        return 1;
+    }
+    const part_mesh mesh = {msquares->points, (size_t)msquares->npoints, msquares->triangles,
+                            (size_t)msquares->ntriangles};
+
+    std::vector<part_ray> rays;
+    if (ray_file) {
+        rays = load_rays(ray_file);
+    }
+    if (rays.empty()) {
+        rays = synthesize_rays(msquares, 100000);
+    }
+    printf("%d triangles, %d rays\n", msquares->ntriangles, (int)rays.size());
+
+    const uint32_t kBinSizes[] = {5, 16, 32, 64};
+    const float kCostAabb[] = {0.1f, 0.2f, 0.4f};
+    const uint32_t kLeafSizes[] = {1, 2, 4, 8};
+    const uint32_t kDepths[] = {32, 256};
+
+    std::vector<Candidate> candidates;
+    for (uint32_t leaf : kLeafSizes) {
+        for (uint32_t depth : kDepths) {
+            part_config config = {};
+            config.min_leaf_primitives = leaf;
+            config.max_tree_depth = depth;
+            for (uint32_t bins : kBinSizes) {
+                for (float cost : kCostAabb) {
+                    config.builder = PART_BUILDER_BINNED_SAH;
+                    config.bin_size = bins;
+                    config.cost_t_aabb = cost;
+                    add_candidate(&candidates, config, mesh, rays);
+                }
+            }
+            config.builder = PART_BUILDER_LBVH;
+            config.bin_size = 0;
+            config.cost_t_aabb = 0.0f;
+            for (int treelets = 0; treelets < 2; treelets++) {
+                config.optimize_treelets = treelets;
+                add_candidate(&candidates, config, mesh, rays);
+            }
+        }
+    }
+
+    const Candidate* best = NULL;
+    for (Candidate& c : candidates) {
+        c.pareto = true;
+        for (const Candidate& other : candidates) {
+            if (dominates(other, c)) {
+                c.pareto = false;
+                break;
+            }
+        }
+        // With positive weights, the cheapest candidate is always on the front.
+        if (!best || c.cost < best->cost) {
+            best = &c;
+        }
+    }
+    if (!best) {
+        fprintf(stderr, "No config could be built\n");
+        return 1;
+    }
+
+    for (const Candidate& c : candidates) {
+        print_candidate(c);
+    }
+    printf("\nPareto front (build time, memory, throughput) is marked with *. Cost is build ms + "
+           "ms to trace %.0f rays + %.1f ms per MiB. Lowest cost:\n",
+           kSessionRays, kMsPerMiB);
+    print_candidate(*best);
+
+    if (!part_write_config(output, &best->config)) {
+        fprintf(stderr, "Unable to write %s\n", output);
+        return 1;
+    }
+    printf("Wrote %s\n", output);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "app.h"
+#include "trace.h"
+#include "update.h"
+
+struct UpdateThreadImpl {
+    App* app;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    bool quit;
+    bool requested;
+    double seconds;
+};
+
+static void* worker(void* arg) {
+    UpdateThread* updater = arg;
+    trace_set_thread_name("update");
+    pthread_mutex_lock(&updater->mutex);
+    while (true) {
+        while (!updater->requested && !updater->quit) {
+            pthread_cond_wait(&updater->wake, &updater->mutex);
+        }
+        if (updater->quit) {
+            break;
+        }
+        updater->requested = false;
+        const double seconds = updater->seconds;
+
+        pthread_mutex_unlock(&updater->mutex);
+        app_update(updater->app, seconds);
+        pthread_mutex_lock(&updater->mutex);
+    }
+    pthread_mutex_unlock(&updater->mutex);
+    return NULL;
+}
+
+UpdateThread* update_create(App* app) {
+    UpdateThread* updater = calloc(1, sizeof(UpdateThread));
+    updater->app = app;
+    pthread_mutex_init(&updater->mutex, NULL);
+    pthread_cond_init(&updater->wake, NULL);
+    pthread_create(&updater->thread, NULL, worker, updater);
+    return updater;
+}
+
+void update_destroy(UpdateThread* updater) {
+    if (!updater) {
+        return;
+    }
+    pthread_mutex_lock(&updater->mutex);
+    updater->quit = true;
+    pthread_cond_signal(&updater->wake);
+    pthread_mutex_unlock(&updater->mutex);
+    pthread_join(updater->thread, NULL);
+    pthread_cond_destroy(&updater->wake);
+    pthread_mutex_destroy(&updater->mutex);
+    free(updater);
+}
+
+void update_request(UpdateThread* updater, double seconds) {
+    pthread_mutex_lock(&updater->mutex);
+    updater->requested = true;
+    updater->seconds = seconds;
+    pthread_cond_signal(&updater->wake);
+    pthread_mutex_unlock(&updater->mutex);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+typedef struct UpdateThreadImpl UpdateThread;
+struct App;
+
+// Runs app_update on its own thread so that slow camera updates, e.g. raycasts or the closest
+// point query, never stall the frame callback. The thread sleeps until a frame requests an update.
+UpdateThread* update_create(struct App* app);
+void update_destroy(UpdateThread* updater);
+
+// Asks for one app_update at the given time. Requests that arrive while an update is still running
+// are merged, and the next update uses the latest time.
+void update_request(UpdateThread* updater, double seconds);